@@ -0,0 +1,19 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <cstdlib>
+
+struct PixelCache;
+struct Image;
+struct BufferPool;
+
+// a directory of decoded pixel files, kept under a size cap by evicting the least recently used
+struct PixelCache * create_pixel_cache(const char * const, const size_t);
+void destroy_pixel_cache(struct PixelCache *);
+
+// reads a region as read_image_region does; an entry for the source's current path, size,
+// mtime and contents is mapped straight into the image, otherwise the region is decoded
+// and stored for next time
+struct Image * read_image_cached(struct PixelCache *, const char * const, struct BufferPool *, const int, const int, const int, const int);
+
+#endif
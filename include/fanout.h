@@ -0,0 +1,15 @@
+#ifndef _FANOUT_H
+#define _FANOUT_H
+
+#include "read_write.h"
+#include "parser.h"
+#include "sorting.h"
+
+// sorts the image with each query and writes each result to the matching destination,
+// running the leading steps that queries share only once; takes ownership of the image
+//
+// with a reference source, each result is also compared against the reference engine's
+// output for that source, and the number of mismatched destinations is returned
+int sort_and_write_all(struct Image *, struct PixelSortQuery * const *, const char * const *, const int, SortEngine_e, const struct Image *);
+
+#endif
@@ -5,8 +5,9 @@
 
 enum Orientation_e { COLUMN, ROW };
 enum RunType_e { FULL, DARK, LIGHT, FIXED };
-enum Comparison_e { AVG, MUL, MAX, MIN, XOR };
+enum Comparison_e { AVG, MUL, MAX, MIN, XOR, LUMA, HUE, SATURATION };
 enum SortDirection_e { ASC, DESC };
+enum Operation_e { SORT, PARTITION, TOP };
 
 struct PixelSortQuery;
 
@@ -18,9 +19,26 @@ void destroy_query(struct PixelSortQuery *);
 int get_subquery_count(const struct PixelSortQuery *);
 void debug_subquery(const struct PixelSortQuery *, const int);
 long get_run_threshold(const struct PixelSortQuery *, const int);
+
+// with an AUTO threshold, the run threshold is the percentage of pixels to put in runs
+int is_auto_threshold(const struct PixelSortQuery *, const int);
 Orientation_e get_orientation(const struct PixelSortQuery *, const int);
 RunType_e get_run_type(const struct PixelSortQuery *, const int);
 Comparison_e get_comparison(const struct PixelSortQuery *, const int);
 SortDirection_e get_sort_direction(const struct PixelSortQuery *, const int);
+Operation_e get_operation(const struct PixelSortQuery *, const int);
+long get_operation_param(const struct PixelSortQuery *, const int);
+
+// block structure; block 0 is the whole query and each REPEAT adds a nested block,
+// whose steps are either subquery indices or (nested) block indices; every block has a
+// repeat count, UNTIL STABLE blocks without one being given a cap
+int get_block_step_count(const struct PixelSortQuery *, const int);
+int is_block_step(const struct PixelSortQuery *, const int, const int);
+int get_step_index(const struct PixelSortQuery *, const int, const int);
+long get_repeat_count(const struct PixelSortQuery *, const int);
+int is_until_stable(const struct PixelSortQuery *, const int);
+
+// whether a top-level step of one query does exactly the same work as one of another
+int is_same_step(const struct PixelSortQuery *, const int, const struct PixelSortQuery *, const int);
 
 #endif
@@ -0,0 +1,16 @@
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include "read_write.h"
+#include "parser.h"
+#include "sorting.h"
+
+// sorts the image and encodes it to the destination, handing scanlines to an encoder
+// thread as the final ROWS subquery finishes them
+void sort_and_write(struct Image *, const struct PixelSortQuery *, SortEngine_e, const char * const);
+
+// as sort_and_write, running only the top-level steps in [first, end), with the parallel
+// encoder's extra threads drawn from the budget (NULL for no budget)
+void sort_steps_and_write(struct Image *, const struct PixelSortQuery *, const int, const int, SortEngine_e, const char * const, struct ThreadBudget *);
+
+#endif
@@ -1,16 +1,62 @@
 #ifndef _READ_WRITE_H
 #define _READ_WRITE_H
 
+#include <cstdlib>
+
 struct Image;
+struct ImageWriter;
+struct ThreadBudget;
+struct BufferPool;
+struct Snapshot;
+
+// the image's buffer is drawn from (and returned to) the given pool
+struct Image * read_image(const char * const, struct BufferPool *);
+
+// decodes only the x, y, width, height region of the source (a zero extent runs to the edge)
+struct Image * read_image_region(const char * const, struct BufferPool *, const int, const int, const int, const int);
+
+// marks an image read from the x, y region of a source; it is then written as the whole
+// source frame with the image composited in, re-encoding only the iMCUs the region touches
+// (the source path must outlive the image)
+void set_image_source(struct Image *, const char * const, const int, const int);
+void write_image(const struct Image *, const char * const, struct ThreadBudget *);
+
+// wraps a buffer already acquired from the pool, which takes it back when the image is destroyed
+struct Image * create_image(struct BufferPool *, unsigned char *, const int, const int, const int);
+void destroy_image(struct Image *);
+
+// copies drawn from the source image's pool; a snapshot copy is copy-on-write, and
+// must come from a snapshot of an image with the same shape
+struct Image * copy_image(const struct Image *);
+struct Image * copy_image_from_snapshot(const struct Image *, const struct Snapshot *);
+
+// incremental encoding, for callers that finish the image a block of scanlines at a time;
+// a writer's strip encoders past the first take their threads from the budget, if given
+struct ImageWriter * open_image_writer(const struct Image *, const char * const, struct ThreadBudget *);
+void write_rows(struct ImageWriter *, const int);
+void close_image_writer(struct ImageWriter *);
+
+// with more than one encoder thread (0 for the default of one per core), images are encoded
+// as horizontal strips in parallel and joined with restart markers; one thread encodes serially
+void set_encoder_threads(const int);
+
+// spare threads a job may start, shared between its fan-out branches and strip encoders
+struct ThreadBudget * create_thread_budget(const int);
+void destroy_thread_budget(struct ThreadBudget *);
+bool try_acquire_thread(struct ThreadBudget *);
+void release_thread(struct ThreadBudget *);
 
-struct Image * read_image(const char * const);
-void write_image(struct Image *, const char * const);
+// bytes of an encoded file that differ from the single-threaded encoder's output with the
+// same restart markers; always 0 for images the writer encodes serially
+size_t count_differing_encoded_bytes(const struct Image *, const char * const);
 
 int get_width(const struct Image * const);
 int get_height(const struct Image * const);
 int get_components(const struct Image * const);
+struct BufferPool * get_buffer_pool(const struct Image * const);
 
 const unsigned char * const get_buffer(const struct Image * const);
-void set_buffer(struct Image *, unsigned char *);
+unsigned char * get_writable_buffer(struct Image *);
+size_t count_differing_bytes(const struct Image *, const struct Image *);
 
 #endif
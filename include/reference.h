@@ -0,0 +1,15 @@
+#ifndef _REFERENCE_H
+#define _REFERENCE_H
+
+#include "read_write.h"
+#include "parser.h"
+
+// the reference engine: each subquery transposes the image plainly when it runs on columns,
+// finds every run and stable-sorts it, and computes AUTO thresholds by sorting every key
+// in the image; it shares no code with the optimized engine beyond the parsed query, so
+// the two can be checked against each other
+//
+// runs the top-level steps in [first, end), as sort_steps does
+void reference_sort_steps(struct Image *, const struct PixelSortQuery *, const int, const int);
+
+#endif
@@ -4,6 +4,24 @@
 #include "read_write.h"
 #include "parser.h"
 
-void sort(struct Image *, const struct PixelSortQuery *);
+// the reference engine (see reference.h) stable-sorts every run of every line with none
+// of the optimized engine's code; the optimized engine must always produce identical
+// pixels, with equal keys keeping their pre-sort order in both
+enum SortEngine_e { REFERENCE_ENGINE, OPTIMIZED_ENGINE };
+
+// called with the number of leading rows whose final pixels are in place
+typedef void(*rows_done_fn_t)(void *, const int);
+
+void sort(struct Image *, const struct PixelSortQuery *, SortEngine_e);
+
+// as sort, but reports rows as they are finished by a trailing ROWS subquery
+void sort_with_progress(struct Image *, const struct PixelSortQuery *, SortEngine_e, rows_done_fn_t, void *);
+
+// as sort_with_progress, running only the top-level steps in [first, end)
+void sort_steps(struct Image *, const struct PixelSortQuery *, const int, const int, SortEngine_e, rows_done_fn_t, void *);
+
+// measures where the optimized engine's run sorts (sorting networks, counting and key sorts) overtake
+// each other on this machine, replacing the cutoffs it was built with
+void autotune_sort_cutoffs();
 
 #endif
@@ -0,0 +1,43 @@
+#ifndef _STORAGE_H
+#define _STORAGE_H
+
+#include <cstdlib>
+
+struct ScratchSpace;
+struct BufferPool;
+struct Snapshot;
+
+// construction and destruction
+struct ScratchSpace * create_scratch_space(const char * const, const size_t);
+void destroy_scratch_space(struct ScratchSpace *);
+
+// disk-backed buffers (an unlinked file in the scratch directory, mmap'd shared)
+unsigned char * map_scratch_buffer(struct ScratchSpace *, const size_t);
+void unmap_scratch_buffer(unsigned char *, const size_t);
+
+// drops the resident pages of a range, leaving the contents in the backing file
+void evict_scratch_pages(const unsigned char *, const size_t);
+
+size_t get_memory_budget(const struct ScratchSpace *);
+
+// a pool of reusable image-sized buffers, owned by a single job; a NULL
+// scratch space gives aligned heap buffers, otherwise they are disk-backed
+struct BufferPool * create_buffer_pool(struct ScratchSpace *);
+void destroy_buffer_pool(struct BufferPool *);
+
+unsigned char * acquire_buffer(struct BufferPool *, const size_t);
+void release_buffer(struct BufferPool *, unsigned char *);
+
+struct ScratchSpace * get_pool_scratch_space(const struct BufferPool *);
+
+// frozen copies of a buffer; each buffer acquired from a snapshot is a copy-on-write
+// mapping of it, and is unmapped (not reused) when released back to the pool; with a
+// scratch space it is instead an ordinary scratch buffer holding a copy of the snapshot
+struct Snapshot * create_snapshot(struct BufferPool *, const unsigned char *, const size_t);
+void destroy_snapshot(struct Snapshot *);
+unsigned char * acquire_snapshot_buffer(struct BufferPool *, const struct Snapshot *);
+
+// as a snapshot buffer, but mapping bytes of any open file from a page-aligned offset
+unsigned char * acquire_file_buffer(struct BufferPool *, const int, const size_t, const size_t);
+
+#endif
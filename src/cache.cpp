@@ -0,0 +1,265 @@
+#include "../include/cache.h"
+#include "../include/read_write.h"
+#include "../include/storage.h"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define CACHE_MAGIC "PXCACHE1"
+#define CACHE_SUFFIX ".px"
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+using namespace std;
+
+typedef struct PixelCache {
+	string directory;
+	size_t max_bytes;
+} PixelCache_t;
+
+// what an entry was decoded from; it is only used when all of it matches
+typedef struct CacheKey {
+	uint64_t path_hash;
+	uint64_t content_hash;
+	int64_t source_size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int32_t region[4];
+} CacheKey_t;
+
+// the start of every entry; the pixels follow at a page-aligned offset so they can be mapped
+typedef struct CacheHeader {
+	char magic[8];
+	CacheKey_t key;
+	int32_t width;
+	int32_t height;
+	int32_t components;
+	uint32_t data_offset;
+} CacheHeader_t;
+
+typedef struct CacheEntry {
+	string path;
+	size_t bytes;
+	struct timespec last_used;
+} CacheEntry_t;
+
+/**
+ * FNV-1a over a range of bytes, continuing from the given hash
+ */
+static uint64_t hash_bytes(const unsigned char *, const size_t, uint64_t);
+
+/**
+ * Fills in the key for a source and region, hashing the source's contents; false if it can't be read
+ */
+static bool create_key(const char * const, const int, const int, const int, const int, CacheKey_t *);
+
+static string get_entry_path(const PixelCache_t *, const CacheKey_t *);
+
+/**
+ * Maps an entry's pixels into an image, marking it as just used; NULL if there's no matching entry
+ */
+static struct Image * load_entry(const string &, const CacheKey_t *, struct BufferPool *);
+
+/**
+ * Writes an image to a temporary file and renames it into place, so readers never see half an entry
+ */
+static void store_entry(const PixelCache_t *, const string &, const CacheKey_t *, const struct Image *);
+
+/**
+ * Removes the least recently used entries until the cache is within its cap
+ */
+static void evict_entries(const PixelCache_t *);
+
+struct PixelCache * create_pixel_cache(const char * const directory, const size_t max_bytes) {
+	if(0 != mkdir(directory, 0755) && EEXIST != errno) {
+		cerr << "unable to create cache directory " << directory << " (" << strerror(errno) << ")" << endl;
+		exit(1);
+	}
+
+	PixelCache_t * cache = new PixelCache_t();
+	cache->directory = string(directory);
+	cache->max_bytes = max_bytes;
+	return cache;
+}
+
+void destroy_pixel_cache(struct PixelCache * cache) {
+	delete cache;
+}
+
+struct Image * read_image_cached(struct PixelCache * cache, const char * const file, struct BufferPool * pool, const int x, const int y, const int width, const int height) {
+	CacheKey_t key;
+	if(!create_key(file, x, y, width, height, &key)) {
+		return read_image_region(file, pool, x, y, width, height);
+	}
+
+	const string path = get_entry_path(cache, &key);
+	struct Image * img = load_entry(path, &key, pool);
+	if(NULL != img) {
+		cout << "cache hit: " << path << endl;
+		cout << "width: " << get_width(img) << " height: " << get_height(img) << endl;
+		return img;
+	}
+
+	img = read_image_region(file, pool, x, y, width, height);
+	store_entry(cache, path, &key, img);
+	evict_entries(cache);
+	return img;
+}
+
+uint64_t hash_bytes(const unsigned char * bytes, const size_t length, uint64_t hash) {
+	for(size_t i = 0; i < length; ++i) {
+		hash = (hash ^ bytes[i]) * FNV_PRIME;
+	}
+	return hash;
+}
+
+bool create_key(const char * const file, const int x, const int y, const int width, const int height, CacheKey_t * key) {
+	const int fd = open(file, O_RDONLY);
+	struct stat info;
+	if(0 > fd || 0 != fstat(fd, &info) || 0 == info.st_size) {
+		if(0 <= fd) close(fd);
+		return false;
+	}
+
+	// padding is hashed and compared along with the fields
+	memset(key, 0, sizeof(CacheKey_t));
+	key->source_size = info.st_size;
+	key->mtime_sec = info.st_mtim.tv_sec;
+	key->mtime_nsec = info.st_mtim.tv_nsec;
+	key->region[0] = x;
+	key->region[1] = y;
+	key->region[2] = width;
+	key->region[3] = height;
+
+	char * const resolved = realpath(file, NULL);
+	const char * const path = (NULL == resolved) ? file : resolved;
+	key->path_hash = hash_bytes((const unsigned char *)path, strlen(path), FNV_OFFSET_BASIS);
+	free(resolved);
+
+	void * const contents = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(MAP_FAILED == contents) return false;
+	madvise(contents, info.st_size, MADV_SEQUENTIAL);
+	key->content_hash = hash_bytes((const unsigned char *)contents, info.st_size, FNV_OFFSET_BASIS);
+	munmap(contents, info.st_size);
+	return true;
+}
+
+string get_entry_path(const PixelCache_t * cache, const CacheKey_t * key) {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx" CACHE_SUFFIX, (unsigned long long)hash_bytes((const unsigned char *)key, sizeof(CacheKey_t), FNV_OFFSET_BASIS));
+	return cache->directory + "/" + name;
+}
+
+struct Image * load_entry(const string & path, const CacheKey_t * key, struct BufferPool * pool) {
+	const int fd = open(path.c_str(), O_RDONLY);
+	if(0 > fd) return NULL;
+
+	CacheHeader_t header;
+	struct stat info;
+	const bool matches = (ssize_t)sizeof(CacheHeader_t) == pread(fd, &header, sizeof(CacheHeader_t), 0)
+		&& 0 == fstat(fd, &info)
+		&& 0 == memcmp(CACHE_MAGIC, header.magic, sizeof(header.magic))
+		&& 0 == memcmp(key, &header.key, sizeof(CacheKey_t))
+		&& (size_t)info.st_size >= header.data_offset + (size_t)header.width * header.height * header.components;
+	if(!matches) {
+		close(fd);
+		return NULL;
+	}
+
+	// the entry's mtime doubles as its last use, for eviction
+	futimens(fd, NULL);
+
+	const size_t bytes = (size_t)header.width * header.height * header.components;
+	unsigned char * buffer = acquire_file_buffer(pool, fd, header.data_offset, bytes);
+	close(fd);
+	return create_image(pool, buffer, header.width, header.height, header.components);
+}
+
+void store_entry(const PixelCache_t * cache, const string & path, const CacheKey_t * key, const struct Image * img) {
+	const size_t bytes = (size_t)get_width(img) * get_height(img) * get_components(img);
+
+	CacheHeader_t header;
+	memset(&header, 0, sizeof(CacheHeader_t));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.key = *key;
+	header.width = get_width(img);
+	header.height = get_height(img);
+	header.components = get_components(img);
+	header.data_offset = sysconf(_SC_PAGESIZE);
+	if(cache->max_bytes < header.data_offset + bytes) return;
+
+	string temp_path = cache->directory + "/.pixelsort-XXXXXX";
+	char * const temp_buffer = strdup(temp_path.c_str());
+	const int fd = mkstemp(temp_buffer);
+	temp_path = temp_buffer;
+	free(temp_buffer);
+	if(0 > fd) {
+		cerr << "unable to create cache entry in " << cache->directory << " (" << strerror(errno) << ")" << endl;
+		return;
+	}
+
+	// a disk-backed image is written a budget's worth at a time, letting each chunk's pages
+	// go once it's written so the entry doesn't fault the whole image in
+	struct ScratchSpace * scratch = get_pool_scratch_space(get_buffer_pool(img));
+	const size_t page = header.data_offset;
+	const size_t chunk = (NULL == scratch) ? bytes : max(page, get_memory_budget(scratch) & ~(page - 1));
+	bool written = (ssize_t)sizeof(CacheHeader_t) == pwrite(fd, &header, sizeof(CacheHeader_t), 0);
+	const unsigned char * pixels = get_buffer(img);
+	for(size_t done = 0; written && done < bytes; ) {
+		const ssize_t result = pwrite(fd, pixels + done, min(chunk, bytes - done), header.data_offset + done);
+		written = (0 < result);
+		if(written && NULL != scratch) evict_scratch_pages(pixels + done, result);
+		if(written) done += result;
+	}
+	close(fd);
+
+	if(!written || 0 != rename(temp_path.c_str(), path.c_str())) {
+		cerr << "unable to write cache entry " << path << " (" << strerror(errno) << ")" << endl;
+		unlink(temp_path.c_str());
+	}
+}
+
+void evict_entries(const PixelCache_t * cache) {
+	DIR * directory = opendir(cache->directory.c_str());
+	if(NULL == directory) return;
+
+	vector<CacheEntry_t> entries;
+	for(struct dirent * item = readdir(directory); NULL != item; item = readdir(directory)) {
+		const size_t length = strlen(item->d_name), suffix_length = strlen(CACHE_SUFFIX);
+		if(length <= suffix_length || 0 != strcmp(CACHE_SUFFIX, item->d_name + length - suffix_length)) continue;
+
+		CacheEntry_t entry;
+		entry.path = cache->directory + "/" + item->d_name;
+		struct stat info;
+		if(0 != stat(entry.path.c_str(), &info)) continue;
+		entry.bytes = info.st_size;
+		entry.last_used = info.st_mtim;
+		entries.push_back(entry);
+	}
+	closedir(directory);
+
+	// keep the most recently used entries that fit
+	sort(entries.begin(), entries.end(), [](const CacheEntry_t & a, const CacheEntry_t & b) {
+		return a.last_used.tv_sec != b.last_used.tv_sec ? a.last_used.tv_sec > b.last_used.tv_sec : a.last_used.tv_nsec > b.last_used.tv_nsec;
+	});
+	size_t total = 0;
+	for(size_t i = 0; i < entries.size(); ++i) {
+		total += entries[i].bytes;
+		if(cache->max_bytes < total) unlink(entries[i].path.c_str());
+	}
+}
@@ -0,0 +1,187 @@
+#include "../include/fanout.h"
+#include "../include/pipeline.h"
+#include "../include/storage.h"
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <iostream>
+
+using namespace std;
+
+// One top-level step in the prefix tree of all queries
+typedef struct FanOutNode {
+	int query_idx;			// any query passing through here; all share the steps so far
+	int step;			// top-level step index (its depth), -1 for the root
+	vector<int> finished;		// queries whose last step is this one
+	vector<struct FanOutNode *> children;
+} FanOutNode_t;
+
+typedef struct FanOutJob {
+	struct PixelSortQuery * const * queries;
+	const char * const * destinations;
+	SortEngine_e engine;
+	const struct Image * reference_source;
+	struct ThreadBudget * threads;
+	atomic<int> mismatches;
+} FanOutJob_t;
+
+/**
+ * Adds a query's steps to the tree, sharing the longest matching prefix
+ */
+static void insert_query(FanOutNode_t *, const FanOutJob_t *, const int);
+
+/**
+ * Frees a node and its subtree
+ */
+static void destroy_node(FanOutNode_t *);
+
+/**
+ * Runs a node's step, along with the straight path of single-child nodes below it,
+ * then fans out; takes ownership of the image
+ */
+static void run_node(FanOutNode_t *, struct Image *, FanOutJob_t *);
+
+/**
+ * Writes the queries finished at a node, then runs each child on its own copy-on-write
+ * snapshot of the image (the last child gets the image itself)
+ */
+static void fan_out(FanOutNode_t *, struct Image *, FanOutJob_t *);
+
+/**
+ * Compares a finished query's output with the reference engine, and its encoding with the
+ * single-threaded encoder, when verifying
+ */
+static void verify_result(const struct Image *, const int, FanOutJob_t *);
+
+int sort_and_write_all(struct Image * img, struct PixelSortQuery * const * queries, const char * const * destinations, const int query_count, SortEngine_e engine, const struct Image * reference_source) {
+	FanOutJob_t job;
+	job.queries = queries;
+	job.destinations = destinations;
+	job.engine = engine;
+	job.reference_source = reference_source;
+	job.threads = create_thread_budget((int)thread::hardware_concurrency() - 1);
+	job.mismatches = 0;
+
+	FanOutNode_t * root = new FanOutNode_t();
+	root->query_idx = 0;
+	root->step = -1;
+	for(int i = 0; i < query_count; ++i) {
+		insert_query(root, &job, i);
+	}
+
+	fan_out(root, img, &job);
+	destroy_node(root);
+	destroy_thread_budget(job.threads);
+	return job.mismatches;
+}
+
+void insert_query(FanOutNode_t * root, const FanOutJob_t * job, const int query_idx) {
+	const struct PixelSortQuery * query = job->queries[query_idx];
+	FanOutNode_t * node = root;
+	for(int step = 0, l = get_block_step_count(query, 0); step < l; ++step) {
+		FanOutNode_t * next = NULL;
+		for(size_t i = 0; i < node->children.size() && NULL == next; ++i) {
+			FanOutNode_t * child = node->children[i];
+			if(is_same_step(job->queries[child->query_idx], step, query, step)) next = child;
+		}
+
+		if(NULL == next) {
+			next = new FanOutNode_t();
+			next->query_idx = query_idx;
+			next->step = step;
+			node->children.push_back(next);
+		} else {
+			cerr << "Query " << query_idx << " shares step " << step << " with query " << next->query_idx << endl;
+		}
+		node = next;
+	}
+	node->finished.push_back(query_idx);
+}
+
+void destroy_node(FanOutNode_t * node) {
+	for(size_t i = 0; i < node->children.size(); ++i) {
+		destroy_node(node->children[i]);
+	}
+	delete node;
+}
+
+void run_node(FanOutNode_t * node, struct Image * img, FanOutJob_t * job) {
+	const int first_step = node->step;
+	while(node->finished.empty() && 1 == node->children.size()) {
+		node = node->children[0];
+	}
+	const struct PixelSortQuery * query = job->queries[node->query_idx];
+
+	// a path ending in a single query can hand its rows straight to the encoder
+	if(1 == node->finished.size() && node->children.empty()) {
+		const int query_idx = node->finished[0];
+		sort_steps_and_write(img, query, first_step, node->step + 1, job->engine, job->destinations[query_idx], job->threads);
+		verify_result(img, query_idx, job);
+		destroy_image(img);
+		return;
+	}
+
+	sort_steps(img, query, first_step, node->step + 1, job->engine, NULL, NULL);
+	fan_out(node, img, job);
+}
+
+void fan_out(FanOutNode_t * node, struct Image * img, FanOutJob_t * job) {
+	for(size_t i = 0; i < node->finished.size(); ++i) {
+		const int query_idx = node->finished[i];
+		write_image(img, job->destinations[query_idx], job->threads);
+		verify_result(img, query_idx, job);
+	}
+
+	const size_t child_count = node->children.size();
+	if(0 == child_count) {
+		destroy_image(img);
+		return;
+	}
+
+	vector<struct Image *> branches;
+	if(1 < child_count) {
+		struct Snapshot * snapshot = create_snapshot(get_buffer_pool(img), get_buffer(img), (size_t)get_width(img) * get_height(img) * get_components(img));
+		for(size_t i = 0; i + 1 < child_count; ++i) {
+			branches.push_back(copy_image_from_snapshot(img, snapshot));
+		}
+		destroy_snapshot(snapshot);
+	}
+	branches.push_back(img);
+
+	// branches run on their own threads while there are cores to spare, sharing them
+	// with the strip encoders
+	vector<thread> workers;
+	for(size_t i = 0; i + 1 < child_count; ++i) {
+		if(try_acquire_thread(job->threads)) {
+			workers.push_back(thread(run_node, node->children[i], branches[i], job));
+		} else {
+			run_node(node->children[i], branches[i], job);
+		}
+	}
+	run_node(node->children[child_count - 1], branches[child_count - 1], job);
+
+	for(size_t i = 0; i < workers.size(); ++i) {
+		workers[i].join();
+		release_thread(job->threads);
+	}
+}
+
+void verify_result(const struct Image * img, const int query_idx, FanOutJob_t * job) {
+	if(NULL == job->reference_source) return;
+
+	struct Image * reference = copy_image(job->reference_source);
+	sort(reference, job->queries[query_idx], REFERENCE_ENGINE);
+
+	const size_t differing = count_differing_bytes(reference, img);
+	cout << "verify " << job->destinations[query_idx] << ": " << differing << " bytes differ from the reference engine" << endl;
+	if(0 < differing) ++job->mismatches;
+	destroy_image(reference);
+
+	// strips encoded in parallel must join into the file one encoder would have written
+	const size_t differing_encoded = count_differing_encoded_bytes(img, job->destinations[query_idx]);
+	if(0 < differing_encoded) {
+		cout << "verify " << job->destinations[query_idx] << ": " << differing_encoded << " encoded bytes differ from the single-threaded encoder" << endl;
+		++job->mismatches;
+	}
+}
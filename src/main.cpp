@@ -5,6 +5,9 @@
 #include "../include/read_write.h"
 #include "../include/sorting.h"
 #include "../include/parser.h"
+#include "../include/storage.h"
+#include "../include/fanout.h"
+#include "../include/cache.h"
 
 #define ARG_ROW "row"
 #define ARG_COLUMN "column"
@@ -20,21 +23,127 @@
 #define ARG_MIN "min"
 #define ARG_XOR "xor"
 
+#define OPT_SCRATCH_DIR "--scratch-dir"
+#define OPT_MEMORY_BUDGET "--memory-budget"
+#define OPT_REGION "--region"
+#define OPT_CROP "--crop"
+#define OPT_ENGINE "--engine"
+#define OPT_VERIFY "--verify"
+#define OPT_AUTOTUNE "--autotune"
+#define OPT_CACHE_DIR "--cache-dir"
+#define OPT_CACHE_SIZE "--cache-size"
+#define OPT_ENCODER_THREADS "--encoder-threads"
+
+#define ARG_REFERENCE "reference"
+#define ARG_OPTIMIZED "optimized"
+
+#define DEFAULT_MEMORY_BUDGET_MB 256
+#define DEFAULT_CACHE_SIZE_MB 1024
+
 int main(const int argc, const char** argv) {
 
-    if(argc != 4) {
-	printf("example usage:  pixelsort [src.jpg] [dest.jpg] <pixelsort query>\n");
-        printf("query syntax: SORT [ROWS|COLUMNS] [ASC|DESC] BY [AVG|MUL|MAX|MIN|XOR] WITH [FULL|DARK <THRESHOLD>|LIGHT <THRESHOLD>|FIXED <THRESHOLD>] RUNS [THEN SORT ...]\n");
+    // leading options configure storage, caching, the region and the sort engine
+    const char* scratch_dir	= NULL;
+    size_t memory_budget_mb	= DEFAULT_MEMORY_BUDGET_MB;
+    const char* cache_dir	= NULL;
+    size_t cache_size_mb	= DEFAULT_CACHE_SIZE_MB;
+    int region[4]		= { 0, 0, 0, 0 };
+    bool composite		= false;
+    SortEngine_e engine		= OPTIMIZED_ENGINE;
+    bool verify			= false;
+    int arg = 1;
+    while(arg < argc && 0 == strncmp(argv[arg], "--", 2)) {
+	const char* option = argv[arg++];
+	if(0 == strcmp(OPT_VERIFY, option)) {
+	    verify = true;
+	    continue;
+	}
+	if(0 == strcmp(OPT_AUTOTUNE, option)) {
+	    autotune_sort_cutoffs();
+	    continue;
+	}
+
+	if(arg >= argc) {
+	    printf("missing value for option: %s\n", option);
+	    return 1;
+	}
+	const char* value = argv[arg++];
+	if(0 == strcmp(OPT_SCRATCH_DIR, option)) {
+	    scratch_dir = value;
+	} else if(0 == strcmp(OPT_MEMORY_BUDGET, option)) {
+	    memory_budget_mb = strtoul(value, NULL, 10);
+	} else if(0 == strcmp(OPT_CACHE_DIR, option)) {
+	    cache_dir = value;
+	} else if(0 == strcmp(OPT_CACHE_SIZE, option)) {
+	    cache_size_mb = strtoul(value, NULL, 10);
+	} else if(0 == strcmp(OPT_ENCODER_THREADS, option)) {
+	    set_encoder_threads(atoi(value));
+	} else if(0 == strcmp(OPT_REGION, option) || 0 == strcmp(OPT_CROP, option)) {
+	    if(4 != sscanf(value, "%d,%d,%d,%d", region, region + 1, region + 2, region + 3)) {
+		printf("expected a region of the form <x>,<y>,<width>,<height>: %s\n", value);
+		return 1;
+	    }
+	    composite = (0 == strcmp(OPT_REGION, option));
+	} else if(0 == strcmp(OPT_ENGINE, option)) {
+	    if(0 == strcmp(ARG_REFERENCE, value)) {
+		engine = REFERENCE_ENGINE;
+	    } else if(0 == strcmp(ARG_OPTIMIZED, value)) {
+		engine = OPTIMIZED_ENGINE;
+	    } else {
+		printf("unknown engine: %s\n", value);
+		return 1;
+	    }
+	} else {
+	    printf("unknown option: %s\n", option);
+	    return 1;
+	}
+    }
+
+    // a source followed by one or more (destination, query) pairs
+    if(argc - arg < 3 || 0 == (argc - arg) % 2) {
+	printf("example usage:  pixelsort [--scratch-dir <dir>] [--memory-budget <MB>] [--cache-dir <dir>] [--cache-size <MB>] [--region|--crop <x>,<y>,<w>,<h>] [--engine reference|optimized] [--encoder-threads <n>] [--verify] [--autotune] [src.jpg] [dest.jpg] <pixelsort query> [[dest.jpg] <pixelsort query> ...]\n");
+        printf("query syntax: [SORT|PARTITION|TOP <K>] [ROWS|COLUMNS] [ASC|DESC] BY [AVG|MUL|MAX|MIN|XOR|LUMA|HUE|SATURATION] [AT <PERCENTILE> (PARTITION only)] WITH [FULL|DARK <THRESHOLD>|LIGHT <THRESHOLD>|DARK AUTO <PERCENT>|LIGHT AUTO <PERCENT>|FIXED <THRESHOLD>] RUNS [THEN SORT ...|THEN REPEAT [<N>] { ... } [UNTIL STABLE]]\n");
         return 1;
     }
 
-    const char* source		= argv[1];
-    const char* destination	= argv[2];
-    const char* query_string	= argv[3];
+    const char* source		= argv[arg];
+    const int query_count	= (argc - arg - 1) / 2;
+    const char** destinations	= new const char*[query_count];
+    struct PixelSortQuery ** queries = new struct PixelSortQuery*[query_count];
+    for(int i = 0; i < query_count; ++i) {
+	destinations[i] = argv[arg + 1 + (2 * i)];
+	queries[i] = process_tokens(argv[arg + 2 + (2 * i)]);
+    }
+
+    struct ScratchSpace * scratch = (NULL == scratch_dir) ? NULL
+	: create_scratch_space(scratch_dir, memory_budget_mb << 20);
+
+    struct BufferPool * pool = create_buffer_pool(scratch);
+
+    struct PixelCache * cache = (NULL == cache_dir) ? NULL
+	: create_pixel_cache(cache_dir, cache_size_mb << 20);
+
+    // the source is decoded once (or not at all, when cached) and shared by every query
+    struct Image * image = (NULL == cache)
+	? read_image_region(source, pool, region[0], region[1], region[2], region[3])
+	: read_image_cached(cache, source, pool, region[0], region[1], region[2], region[3]);
+
+    // a sorted region is written back into the full frame, unless it was cropped out
+    if(composite) set_image_source(image, source, region[0], region[1]);
+
+    // --verify checks every result against the reference engine run over a pristine copy
+    struct Image * reference_source = verify ? copy_image(image) : NULL;
+    const int mismatches = sort_and_write_all(image, queries, destinations, query_count, engine, reference_source);
+    if(NULL != reference_source) destroy_image(reference_source);
+
+    for(int i = 0; i < query_count; ++i) {
+	destroy_query(queries[i]);
+    }
+    delete[] queries;
+    delete[] destinations;
 
-    struct PixelSortQuery * query = process_tokens(query_string);
-    struct Image * image = read_image(source);
-    sort(image, query);
-    write_image(image, destination);
-    destroy_query(query);
+    destroy_buffer_pool(pool);
+    if(NULL != cache) destroy_pixel_cache(cache);
+    if(NULL != scratch) destroy_scratch_space(scratch);
+    return (0 == mismatches) ? 0 : 2;
 }
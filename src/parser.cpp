@@ -6,12 +6,10 @@
 
 #include <cstring>
 #include <cstdlib>
+#include <cctype>
 #include <cstdio>
 #include <cassert>
 
-#define COPY_BUFFER_SIZE 4096
-#define SUBQUERY_COUNT 256
-
 using namespace std;
 
 // structural tokens
@@ -21,6 +19,21 @@ static const string WITH_TK	= string("WITH");
 static const string RUNS_TK	= string("RUNS");
 static const string THEN_TK	= string("THEN");
 
+// selection tokens
+static const string PARTITION_TK = string("PARTITION");
+static const string TOP_TK	= string("TOP");
+static const string AT_TK	= string("AT");
+
+// repetition tokens
+static const string REPEAT_TK	= string("REPEAT");
+static const string UNTIL_TK	= string("UNTIL");
+static const string STABLE_TK	= string("STABLE");
+static const string OPEN_TK	= string("{");
+static const string CLOSE_TK	= string("}");
+
+// passes an UNTIL STABLE block without a count gets, in case its steps never settle
+static const long MAX_STABLE_PASSES = 100;
+
 // orientation tokens
 static const string ROW_TK	= string("ROWS");
 static const string COL_TK	= string("COLS");
@@ -35,76 +48,115 @@ static const string MUL_TK	= string("MUL");
 static const string MAX_TK	= string("MAX");
 static const string MIN_TK	= string("MIN");
 static const string XOR_TK	= string("XOR");
+static const string LUMA_TK	= string("LUMA");
+static const string HUE_TK	= string("HUE");
+static const string SAT_TK	= string("SATURATION");
 
 // run type tokens
 static const string FULL_TK	= string("FULL");
 static const string DARK_TK	= string("DARK");
 static const string LIGHT_TK	= string("LIGHT");
 static const string FIXED_TK	= string("FIXED");
+static const string AUTO_TK	= string("AUTO");
 
 struct PixelSortSubquery;
+struct PixelSortBlock;
 
 typedef struct PixelSortQuery {
-    size_t subquery_count;
-    struct PixelSortSubquery * subqueries[SUBQUERY_COUNT];
+    vector<struct PixelSortSubquery *> subqueries;
+    vector<struct PixelSortBlock *> blocks;
 } PixelSortQuery_t;
 
 typedef struct PixelSortSubquery {
+    Operation_e	    operation;
+    size_t	    operation_param;
     Orientation_e   orientation;
     Comparison_e    comparison;
     SortDirection_e sort_direction;
     RunType_e	    run_type;
     size_t	    run_type_param;
+    bool	    run_type_auto;
 } PixelSortSubquery_t;
 
-static int process_subquery(PixelSortSubquery_t *, const vector<string> &, size_t);
+// a step is either a subquery or a nested block, by index
+typedef struct PixelSortStep {
+    bool    is_block;
+    int	    index;
+} PixelSortStep_t;
+
+typedef struct PixelSortBlock {
+    long    repeat_count;
+    bool    until_stable;
+    vector<PixelSortStep_t> steps;
+} PixelSortBlock_t;
+
+static size_t process_chain(PixelSortQuery_t *, const int, const vector<string> &, size_t);
+static size_t process_repeat(PixelSortQuery_t *, const int, const vector<string> &, size_t);
+static size_t process_subquery(PixelSortSubquery_t *, const vector<string> &, size_t);
+static size_t process_threshold(PixelSortSubquery_t *, const vector<string> &, size_t);
+static const string & next_token(const vector<string> &, size_t &);
+static bool is_same_block(const PixelSortQuery_t *, const int, const PixelSortQuery_t *, const int);
+static bool is_same_subquery(const PixelSortSubquery_t *, const PixelSortSubquery_t *);
 static void debug_subquery(const PixelSortSubquery_t *);
 
 PixelSortQuery_t * process_tokens(const char* query_string) {
 
-    // create a copy of the input and the token vector
+    // split the input into tokens, braces being tokens of their own
     vector<string> tokens;
-    char query_string_buffer[COPY_BUFFER_SIZE];
-    char * token = strtok(strncpy(query_string_buffer, query_string, COPY_BUFFER_SIZE), " ");
-    while(token) {
-	if(0 < strlen(token)) {
-	    tokens.push_back(string(token));
-	    cerr << "Found token: " << token << endl;
+    string token;
+    for(const char * c = query_string; ; ++c) {
+	const bool is_brace = ('{' == *c || '}' == *c);
+	if('\0' == *c || isspace(*c) || is_brace) {
+	    if(0 < token.size()) {
+		tokens.push_back(token);
+		cerr << "Found token: " << token << endl;
+		token.clear();
+	    }
+	    if(is_brace) tokens.push_back(string(1, *c));
+	    if('\0' == *c) break;
+	} else {
+	    token += *c;
 	}
-	token = strtok(NULL, " ");
     }
 
 
-    // create and initialize the query instance
+    // create the query instance, with block 0 holding the top-level chain
     PixelSortQuery_t * query = new PixelSortQuery_t();
-    query->subquery_count = 0;
-    for(int i = 0; i < SUBQUERY_COUNT; ++i) query->subqueries[i] = NULL;
+    PixelSortBlock_t * top_level = new PixelSortBlock_t();
+    top_level->repeat_count = 1;
+    top_level->until_stable = false;
+    query->blocks.push_back(top_level);
 
     // process tokens and create subqueries
-    int token_idx = 0;
-    do {
-	const size_t subquery_idx = query->subquery_count++;
-	PixelSortSubquery_t * subquery = new PixelSortSubquery_t();
-	query->subqueries[subquery_idx] = subquery;
-	token_idx = process_subquery(subquery, tokens, token_idx);
-    } while(0 < token_idx);
+    const size_t token_idx = process_chain(query, 0, tokens, 0);
+    if(tokens.size() > token_idx) {
+	cerr << "Unexpected token after end of query: " << tokens[token_idx] << endl;
+	exit(1);
+    }
 
+    cerr << "End-Of-Input" << endl;
     return query;
 }
 
 void destroy_query(PixelSortQuery_t * query) {
-    for(int i = 0; i < query->subquery_count; ++i) {
-	free(query->subqueries[i]);
+    for(size_t i = 0; i < query->subqueries.size(); ++i) {
+	delete query->subqueries[i];
+    }
+    for(size_t i = 0; i < query->blocks.size(); ++i) {
+	delete query->blocks[i];
     }
-    free(query);
+    delete query;
 }
 
 void debug_subquery(const PixelSortSubquery_t * subquery) {
+    cerr << "Operation: " << subquery->operation << endl;
+    cerr << "Operation Param: " << subquery->operation_param << endl;
     cerr << "Orientation: " << subquery->orientation << endl;
     cerr << "Comparison: " << subquery->comparison << endl;
     cerr << "Sort Direction: " << subquery->sort_direction << endl;
     cerr << "Run Type: " << subquery->run_type << endl;
     cerr << "Run Type Param: " << subquery->run_type_param << endl;
+    cerr << "Run Type Auto: " << subquery->run_type_auto << endl;
 }
 
 void debug_subquery(const struct PixelSortQuery * q, const int i) {
@@ -114,13 +166,46 @@ void debug_subquery(const struct PixelSortQuery * q, const int i) {
 }
 
 int get_subquery_count(const struct PixelSortQuery * q) {
-    return q->subquery_count; 
+    return q->subqueries.size(); 
+}
+
+int get_block_step_count(const struct PixelSortQuery * q, const int b) {
+    return q->blocks[b]->steps.size();
+}
+
+int is_block_step(const struct PixelSortQuery * q, const int b, const int s) {
+    return q->blocks[b]->steps[s].is_block ? 1 : 0;
+}
+
+int get_step_index(const struct PixelSortQuery * q, const int b, const int s) {
+    return q->blocks[b]->steps[s].index;
+}
+
+long get_repeat_count(const struct PixelSortQuery * q, const int b) {
+    return q->blocks[b]->repeat_count;
+}
+
+int is_until_stable(const struct PixelSortQuery * q, const int b) {
+    return q->blocks[b]->until_stable ? 1 : 0;
+}
+
+int is_same_step(const struct PixelSortQuery * q, const int s, const struct PixelSortQuery * r, const int t) {
+    const PixelSortStep_t & q_step = q->blocks[0]->steps[s];
+    const PixelSortStep_t & r_step = r->blocks[0]->steps[t];
+    if(q_step.is_block != r_step.is_block) return 0;
+    if(q_step.is_block) return is_same_block(q, q_step.index, r, r_step.index) ? 1 : 0;
+
+    return is_same_subquery(q->subqueries[q_step.index], r->subqueries[r_step.index]) ? 1 : 0;
 }
 
 long get_run_threshold(const struct PixelSortQuery * q, const int i) {
     return q->subqueries[i]->run_type_param;
 }
 
+int is_auto_threshold(const struct PixelSortQuery * q, const int i) {
+    return q->subqueries[i]->run_type_auto ? 1 : 0;
+}
+
 Orientation_e get_orientation(const struct PixelSortQuery * q, const int i) {
     return q->subqueries[i]->orientation;
 }
@@ -137,25 +222,174 @@ SortDirection_e get_sort_direction(const struct PixelSortQuery * q, const int i)
     return q->subqueries[i]->sort_direction;
 }
 
+Operation_e get_operation(const struct PixelSortQuery * q, const int i) {
+    return q->subqueries[i]->operation;
+}
+
+long get_operation_param(const struct PixelSortQuery * q, const int i) {
+    return q->subqueries[i]->operation_param;
+}
+
 ///////////////////////////////////
 // static method definitions
 ///////////////////////////////////
 
-int process_subquery(PixelSortSubquery_t * subquery, const vector<string> &tokens, size_t token_idx) {
+size_t process_chain(PixelSortQuery_t * query, const int block_idx, const vector<string> &tokens, size_t token_idx) {
+    cerr << "Starting parse of chain in block " << block_idx << endl;
+
+    do {
+	PixelSortStep_t step;
+	if(tokens.size() > token_idx && 0 == REPEAT_TK.compare(tokens[token_idx])) {
+	    step.is_block = true;
+	    step.index = query->blocks.size();
+	    query->blocks.push_back(new PixelSortBlock_t());
+	    token_idx = process_repeat(query, step.index, tokens, token_idx);
+	} else {
+	    step.is_block = false;
+	    step.index = query->subqueries.size();
+	    query->subqueries.push_back(new PixelSortSubquery_t());
+	    token_idx = process_subquery(query->subqueries[step.index], tokens, token_idx);
+	}
+	query->blocks[block_idx]->steps.push_back(step);
+
+
+	// see if there is another step, else we're at the end of the chain
+	if(tokens.size() > token_idx && 0 == THEN_TK.compare(tokens[token_idx])) {
+	    cerr << "Processing then token: " << tokens[token_idx] << endl;
+	    cerr << "Next step begins at: " << ++token_idx << endl;
+	} else {
+	    return token_idx;
+	}
+    } while(true);
+}
+
+size_t process_repeat(PixelSortQuery_t * query, const int block_idx, const vector<string> &tokens, size_t token_idx) {
+    cerr << "Starting parse of repeat block " << block_idx << endl;
+    PixelSortBlock_t * block = query->blocks[block_idx];
+    block->repeat_count = 0;
+    block->until_stable = false;
+
+
+    // 1) the "REPEAT" token, then an optional iteration count
+    const string repeat_token = next_token(tokens, token_idx);
+    cerr << "Processing repeat token: " << repeat_token << endl;
+
+    string token = next_token(tokens, token_idx);
+    if(0 != OPEN_TK.compare(token)) {
+	cerr << "Processing repeat count token: " << token << endl;
+	block->repeat_count = stol(token);
+	if(1 > block->repeat_count) {
+	    cerr << "Repeat count must be at least 1: " << token << endl;
+	    exit(1);
+	}
+	token = next_token(tokens, token_idx);
+    }
+
+
+    // 2) the braced chain
+    if(0 != OPEN_TK.compare(token)) {
+	cerr << "Expected repeated chain to begin with: " << OPEN_TK << endl;
+	exit(1);
+    }
+    token_idx = process_chain(query, block_idx, tokens, token_idx);
+    const string close_token = next_token(tokens, token_idx);
+    if(0 != CLOSE_TK.compare(close_token)) {
+	cerr << "Expected repeated chain to end with: " << CLOSE_TK << " but found: " << close_token << endl;
+	exit(1);
+    }
+
+
+    // 3) an optional "UNTIL STABLE", which stops once a pass leaves the image as it was
+    if(tokens.size() > token_idx && 0 == UNTIL_TK.compare(tokens[token_idx])) {
+	++token_idx;
+	const string stable_token = next_token(tokens, token_idx);
+	cerr << "Processing until token: " << stable_token << endl;
+	if(0 != STABLE_TK.compare(stable_token)) {
+	    cerr << "Expected " << UNTIL_TK << " to be followed by: " << STABLE_TK << endl;
+	    exit(1);
+	}
+	block->until_stable = true;
+    }
+
+    if(0 == block->repeat_count && !block->until_stable) {
+	cerr << "A repeat without a count must end with: " << UNTIL_TK << " " << STABLE_TK << endl;
+	exit(1);
+    }
+    if(0 == block->repeat_count) {
+	cerr << "Repeating until stable, for at most " << MAX_STABLE_PASSES << " passes" << endl;
+	block->repeat_count = MAX_STABLE_PASSES;
+    }
+
+    return token_idx;
+}
+
+bool is_same_block(const PixelSortQuery_t * q, const int b, const PixelSortQuery_t * r, const int c) {
+    const PixelSortBlock_t * q_block = q->blocks[b];
+    const PixelSortBlock_t * r_block = r->blocks[c];
+    if(q_block->repeat_count != r_block->repeat_count || q_block->until_stable != r_block->until_stable) return false;
+    if(q_block->steps.size() != r_block->steps.size()) return false;
+
+    for(size_t i = 0; i < q_block->steps.size(); ++i) {
+	const PixelSortStep_t & q_step = q_block->steps[i];
+	const PixelSortStep_t & r_step = r_block->steps[i];
+	if(q_step.is_block != r_step.is_block) return false;
+	const bool same = q_step.is_block
+	    ? is_same_block(q, q_step.index, r, r_step.index)
+	    : is_same_subquery(q->subqueries[q_step.index], r->subqueries[r_step.index]);
+	if(!same) return false;
+    }
+    return true;
+}
+
+bool is_same_subquery(const PixelSortSubquery_t * a, const PixelSortSubquery_t * b) {
+    return a->operation == b->operation
+	&& a->operation_param == b->operation_param
+	&& a->orientation == b->orientation
+	&& a->comparison == b->comparison
+	&& a->sort_direction == b->sort_direction
+	&& a->run_type == b->run_type
+	&& a->run_type_param == b->run_type_param
+	&& a->run_type_auto == b->run_type_auto;
+}
+
+const string & next_token(const vector<string> &tokens, size_t &token_idx) {
+    if(tokens.size() <= token_idx) {
+	cerr << "Unexpected end of query" << endl;
+	exit(1);
+    }
+    return tokens[token_idx++];
+}
+
+size_t process_subquery(PixelSortSubquery_t * subquery, const vector<string> &tokens, size_t token_idx) {
     cerr << "Starting parse of subquery" << endl;
 
 
-    // 1) ensure we're starting with a valid query
-    const string sort_token = tokens.at(token_idx++);
+    // 1) ensure we're starting with a valid query, where TOP is followed by its pixel count
+    const string sort_token = next_token(tokens, token_idx);
     cerr << "Processing sort keyword token: " << sort_token << endl;
-    if(0 != SORT_TK.compare(sort_token)) {
-	cerr << "Expected first subquery token to be " << SORT_TK << endl;
+    subquery->operation_param = 0;
+    if(0 == SORT_TK.compare(sort_token)) {
+	subquery->operation = SORT;
+    } else if(0 == PARTITION_TK.compare(sort_token)) {
+	subquery->operation = PARTITION;
+    } else if(0 == TOP_TK.compare(sort_token)) {
+	subquery->operation = TOP;
+	const string count_token = next_token(tokens, token_idx);
+	cerr << "Processing top count token: " << count_token << endl;
+	const long count = stol(count_token);
+	if(1 > count) {
+	    cerr << "Top count must be at least 1: " << count_token << endl;
+	    exit(1);
+	}
+	subquery->operation_param = count;
+    } else {
+	cerr << "Expected first subquery token to be " << SORT_TK << ", " << PARTITION_TK << " or " << TOP_TK << endl;
 	exit(1);
     }
 
     
     // 2) advance to the orientation token
-    const string orientation_token = string(tokens[token_idx++]);
+    const string orientation_token = next_token(tokens, token_idx);
     cerr << "Processing orientation token: " << orientation_token << endl;
 
     if(0 == ROW_TK.compare(orientation_token)) {
@@ -169,7 +403,7 @@ int process_subquery(PixelSortSubquery_t * subquery, const vector<string> &token
     
 
     // 3) advance to the sort order token
-    const string sort_order_token = string(tokens[token_idx++]);
+    const string sort_order_token = next_token(tokens, token_idx);
     cerr << "Processing sort order token: " << sort_order_token << endl;
 
     if(0 == ASC_TK.compare(sort_order_token)) {
@@ -183,7 +417,7 @@ int process_subquery(PixelSortSubquery_t * subquery, const vector<string> &token
 
 
     // 4) ensure we're at the "BY" token
-    const string by_token = string(tokens[token_idx++]);
+    const string by_token = next_token(tokens, token_idx);
     cerr << "Processing by token: " << by_token << endl;
     if(0 != BY_TK.compare(by_token)) {
 	cerr << "Expected comparator clause to begin with: " << BY_TK << endl;
@@ -192,7 +426,7 @@ int process_subquery(PixelSortSubquery_t * subquery, const vector<string> &token
 
 
     // 5) extract the comparator token
-    const string comparator_token = string(tokens[token_idx++]);
+    const string comparator_token = next_token(tokens, token_idx);
     cerr << "Processing comparator token: " << comparator_token << endl;
 
     if(0 == AVG_TK.compare(comparator_token)) {
@@ -205,14 +439,40 @@ int process_subquery(PixelSortSubquery_t * subquery, const vector<string> &token
 	subquery->comparison = MAX;
     } else if(0 == XOR_TK.compare(comparator_token)) {
 	subquery->comparison = XOR;
+    } else if(0 == LUMA_TK.compare(comparator_token)) {
+	subquery->comparison = LUMA;
+    } else if(0 == HUE_TK.compare(comparator_token)) {
+	subquery->comparison = HUE;
+    } else if(0 == SAT_TK.compare(comparator_token)) {
+	subquery->comparison = SATURATION;
     } else {
 	cerr << "Comparator token is invalid: " << comparator_token << endl;
 	exit(1);
     }
 
 
+    // 5a) a partition gives the percentile it splits each run at
+    if(PARTITION == subquery->operation) {
+	const string at_token = next_token(tokens, token_idx);
+	cerr << "Processing at token: " << at_token << endl;
+	if(0 != AT_TK.compare(at_token)) {
+	    cerr << "Expected partition percentile to begin with: " << AT_TK << endl;
+	    exit(1);
+	}
+
+	const string percentile_token = next_token(tokens, token_idx);
+	cerr << "Processing percentile token: " << percentile_token << endl;
+	const long percentile = stol(percentile_token);
+	if(0 > percentile || 100 < percentile) {
+	    cerr << "Partition percentile must be between 0 and 100: " << percentile_token << endl;
+	    exit(1);
+	}
+	subquery->operation_param = percentile;
+    }
+
+
     // 6) ensure we're at the "WITH" token
-    const string with_token = string(tokens[token_idx++]);
+    const string with_token = next_token(tokens, token_idx);
     cerr << "Processing with token: " << with_token << endl;
     if(0 != WITH_TK.compare(with_token)) {
 	cerr << "Expected run-type clause to begin with: " << WITH_TK << endl;
@@ -221,25 +481,21 @@ int process_subquery(PixelSortSubquery_t * subquery, const vector<string> &token
     
 
     // 7) extract the run type (and optional threshold)
-    const string run_type_token = string(tokens[token_idx++]);
+    const string run_type_token = next_token(tokens, token_idx);
     cerr << "Processing run type token: " << run_type_token << endl;
     if(0 == FULL_TK.compare(run_type_token)) {
 	subquery->run_type = FULL;
     } else if(0 == FIXED_TK.compare(run_type_token)) {
 	subquery->run_type = FIXED;
-	const string param_token = string(tokens[token_idx++]);
+	const string param_token = next_token(tokens, token_idx);
 	cerr << "Processing param token: " << param_token << endl;
 	subquery->run_type_param = stoi(param_token);
     } else if(0 == LIGHT_TK.compare(run_type_token)) {
 	subquery->run_type = LIGHT;
-	const string param_token = string(tokens[token_idx++]);
-	cerr << "Processing param token: " << param_token << endl;
-	subquery->run_type_param = stoi(param_token);
+	token_idx = process_threshold(subquery, tokens, token_idx);
     } else if(0 == DARK_TK.compare(run_type_token)) {
 	subquery->run_type = DARK;
-	const string param_token = string(tokens[token_idx++]);
-	cerr << "Processing param token: " << param_token << endl;
-	subquery->run_type_param = stoi(param_token);
+	token_idx = process_threshold(subquery, tokens, token_idx);
     } else {
 	cerr << "Run Type token is invalid: " << run_type_token << endl;
 	exit(1);
@@ -247,27 +503,33 @@ int process_subquery(PixelSortSubquery_t * subquery, const vector<string> &token
 
 
     // 8) extract the final tokens and determine the return
-    const string runs_token = string(tokens[token_idx++]);
+    const string runs_token = next_token(tokens, token_idx);
     cerr << "Processing runs token: " << runs_token << endl;
     if(0 != RUNS_TK.compare(runs_token)) {
 	cerr << "Expected run-type clause to end with: " << RUNS_TK << endl;
 	exit(1);
     }
 
+    return token_idx;
+}
 
-    // 9) see if there is another subquery, else we're at EOF
-    if(tokens.size() > token_idx) {
-	const string then_token = string(tokens[token_idx++]);
-	cerr << "Processing then token: " << then_token << endl;
-	if(0 != THEN_TK.compare(then_token)) {
-	    cerr << "Expected another subquery but found: " << then_token << endl;
-	    exit(1);
-	} else {
-	    cerr << "Next subquery begins at: " << token_idx << endl;
-	    return token_idx;
-	}
-    } else {
-	cerr << "End-Of-Input" << endl;
-	return -1;
+size_t process_threshold(PixelSortSubquery_t * subquery, const vector<string> &tokens, size_t token_idx) {
+    const string param_token = next_token(tokens, token_idx);
+    cerr << "Processing param token: " << param_token << endl;
+    if(0 != AUTO_TK.compare(param_token)) {
+	subquery->run_type_param = stoi(param_token);
+	return token_idx;
+    }
+
+    // AUTO picks the threshold that puts the given percentage of pixels in runs
+    const string percentile_token = next_token(tokens, token_idx);
+    cerr << "Processing percentile token: " << percentile_token << endl;
+    const long percentile = stol(percentile_token);
+    if(0 > percentile || 100 < percentile) {
+	cerr << "Auto threshold percentile must be between 0 and 100: " << percentile_token << endl;
+	exit(1);
     }
+    subquery->run_type_auto = true;
+    subquery->run_type_param = percentile;
+    return token_idx;
 }
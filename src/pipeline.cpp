@@ -0,0 +1,66 @@
+#include "../include/pipeline.h"
+#include "../include/sorting.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+typedef struct EncodeProgress {
+	mutex lock;
+	condition_variable rows_ready;
+	int rows_done;
+} EncodeProgress_t;
+
+/**
+ * Progress callback for the sorter; wakes the encoder when more rows are final
+ */
+static void publish_rows(void *, const int);
+
+/**
+ * Encoder thread body; writes rows as they're published until the image is done
+ */
+static void encode_rows(struct ImageWriter *, const int, EncodeProgress_t *);
+
+void sort_and_write(struct Image * img, const struct PixelSortQuery * query, SortEngine_e engine, const char * const file) {
+	sort_steps_and_write(img, query, 0, get_block_step_count(query, 0), engine, file, NULL);
+}
+
+void sort_steps_and_write(struct Image * img, const struct PixelSortQuery * query, const int first_step, const int end_step, SortEngine_e engine, const char * const file, struct ThreadBudget * budget) {
+	EncodeProgress_t progress;
+	progress.rows_done = 0;
+
+	struct ImageWriter * writer = open_image_writer(img, file, budget);
+	thread encoder(encode_rows, writer, get_height(img), &progress);
+
+	sort_steps(img, query, first_step, end_step, engine, publish_rows, &progress);
+
+	encoder.join();
+	close_image_writer(writer);
+}
+
+void publish_rows(void * ctx, const int rows_done) {
+	EncodeProgress_t * progress = (EncodeProgress_t *)ctx;
+	{
+		lock_guard<mutex> guard(progress->lock);
+		progress->rows_done = rows_done;
+	}
+	progress->rows_ready.notify_one();
+}
+
+void encode_rows(struct ImageWriter * writer, const int height, EncodeProgress_t * progress) {
+	int rows_written = 0;
+	while(rows_written < height) {
+		int rows_done;
+		{
+			unique_lock<mutex> guard(progress->lock);
+			progress->rows_ready.wait(guard, [&]{ return rows_written < progress->rows_done; });
+			rows_done = progress->rows_done;
+		}
+
+		// encode outside the lock so the sorter never waits on us
+		write_rows(writer, rows_done);
+		rows_written = rows_done;
+	}
+}
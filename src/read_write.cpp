@@ -1,6 +1,11 @@
 #include "../include/read_write.h"
+#include "../include/storage.h"
 
 #include <iostream>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <atomic>
 
 #include <cstdlib>
 #include <cassert>
@@ -13,20 +18,77 @@ using namespace std;
 
 static const int STRIDES = 1;
 
+// restart markers count modulo 8, so strips span a multiple of 8 MCU rows to keep
+// each strip's own marker numbering valid in the joined image
+static const int RESTART_MARKER_CYCLE = 8;
+static const int STRIPS_PER_THREAD = 4;
+static const unsigned char JPEG_MARKER = 0xFF;
+static const unsigned char SOF0_MARKER = 0xC0;
+static const unsigned char SOS_MARKER = 0xDA;
+static const unsigned char RST0_MARKER = 0xD0;
+static const unsigned char EOI_MARKER = 0xD9;
+
+// threads encoding each image; one means a single serial encoder
+static int encoder_threads = max(1u, thread::hardware_concurrency());
+
 typedef struct jpeg_decompress_struct jpeg_decompress_t;
 typedef struct jpeg_compress_struct jpeg_compress_t;
 typedef struct jpeg_error_mgr jpeg_error_mgr_t;
 
 typedef struct Pixel Pixel_t;
 
+typedef struct ThreadBudget {
+	atomic<int> idle_threads;
+} ThreadBudget_t;
+
 typedef struct Image {
 	unsigned char *buffer;
 	int width;
 	int height;
 	int components;
+	struct BufferPool *pool;
+
+	// the source this region is composited back into when written (NULL to write it as is),
+	// and where it was asked for, before clamping
+	const char *source;
+	int source_x;
+	int source_y;
 } Image_t;
 
-struct Image * read_image(const char * const file) {
+static size_t get_buffer_size(const Image_t *);
+
+/**
+ * Clamps a region to the image, where an empty extent means "to the edge"; fills in left, top, width, height
+ */
+static void clamp_region(const int, const int, const int, const int, const int, const int, int *);
+
+/**
+ * Decodes a region of the source, as read_image_region does, without reporting it
+ */
+static Image_t * decode_region(const char * const, struct BufferPool *, const int, const int, const int, const int);
+
+/**
+ * Number of scanlines that fit in the pool's memory budget (all of them for in-memory pools)
+ */
+static int get_rows_per_budget(const Image_t *);
+
+struct Image * read_image(const char * const file, struct BufferPool * pool) {
+	return read_image_region(file, pool, 0, 0, 0, 0);
+}
+
+struct Image * read_image_region(const char * const file, struct BufferPool * pool, const int x, const int y, const int width, const int height) {
+	Image_t * img = decode_region(file, pool, x, y, width, height);
+	cout << "width: " << img->width << " height: " << img->height << endl;
+	return img;
+}
+
+void set_image_source(struct Image * img, const char * const source, const int x, const int y) {
+	img->source = source;
+	img->source_x = x;
+	img->source_y = y;
+}
+
+Image_t * decode_region(const char * const file, struct BufferPool * pool, const int x, const int y, const int width, const int height) {
 	FILE * src;
 	if(NULL == (src = fopen(file, "rb"))) {
 		cout << "unable to open source file: " << file << endl;
@@ -49,74 +111,316 @@ struct Image * read_image(const char * const file) {
 	// Start decompression
 	jpeg_start_decompress(&d_info);
 
-	// Create the img object we'll write into
-	img->width = d_info.output_width;
-	img->height = d_info.output_height;
+	// Clamp the region to the image, where an empty extent means "to the edge"
+	const int full_width = d_info.output_width;
+	int region[4];
+	clamp_region(full_width, d_info.output_height, x, y, width, height, region);
+	const int left = region[0], top = region[1];
+	img->width = region[2];
+	img->height = region[3];
 	img->components = d_info.output_components;
-	img->buffer = new unsigned char[img->width * img->height * img->components];
+	img->pool = pool;
+	img->buffer = acquire_buffer(pool, get_buffer_size(img));
+	img->source = NULL;
+
+	// Only decode the iMCU columns that cover the region (plus a pixel either side, so
+	// upsampling at the region's edges sees the same neighbours as a full decode); the
+	// decoder widens the crop to iMCU boundaries, so the region starts column_skip pixels in
+	int column_skip = left;
+#ifdef LIBJPEG_TURBO_VERSION
+	if(img->width < full_width) {
+		const int crop_left = max(left - 1, 0), crop_right = min(left + img->width + 1, full_width);
+		JDIMENSION crop_x = crop_left, crop_width = crop_right - crop_left;
+		jpeg_crop_scanline(&d_info, &crop_x, &crop_width);
+		column_skip = left - crop_x;
+	}
+#endif
 
 	// Create a sample row
 	const int d_row_stride = img->width * img->components;
-	JSAMPARRAY d_buf = (d_info.mem->alloc_sarray)((j_common_ptr)&d_info, JPOOL_IMAGE, d_row_stride, STRIDES);
-
-	// Read in the lines
-	for(int counter = 0; d_info.output_scanline < d_info.output_height; ++counter) {
+	JSAMPARRAY d_buf = (d_info.mem->alloc_sarray)((j_common_ptr)&d_info, JPOOL_IMAGE, d_info.output_width * img->components, STRIDES);
+
+	// Skip the scanlines above the region
+#ifdef LIBJPEG_TURBO_VERSION
+	if(0 < top) jpeg_skip_scanlines(&d_info, top);
+#else
+	while(d_info.output_scanline < (JDIMENSION)top) jpeg_read_scanlines(&d_info, d_buf, STRIDES);
+#endif
+
+	// Read in the lines, flushing decoded rows to disk once a budget's worth is resident
+	const int budget_rows = get_rows_per_budget(img);
+	for(int counter = 0; counter < img->height; ++counter) {
 		jpeg_read_scanlines(&d_info, d_buf, STRIDES);
-		memcpy(img->buffer + (counter * img->width * img->components), *d_buf, d_row_stride);
+		memcpy(img->buffer + ((size_t)counter * d_row_stride), *d_buf + (column_skip * img->components), d_row_stride);
+		if(budget_rows < img->height && 0 == (counter + 1) % budget_rows) {
+			evict_scratch_pages(img->buffer + ((size_t)(counter + 1 - budget_rows) * d_row_stride), (size_t)budget_rows * d_row_stride);
+		}
 	}
 
-	// Finish decompression and release memory
-	jpeg_finish_decompress(&d_info);
+	// Finish decompression (leaving any scanlines below the region undecoded) and release memory
+	if(d_info.output_scanline < d_info.output_height) {
+		jpeg_abort_decompress(&d_info);
+	} else {
+		jpeg_finish_decompress(&d_info);
+	}
 	jpeg_destroy_decompress(&d_info);
 	fclose(src);
 
-	cout << "width: " << img->width << " height: " << img->height << endl;
-
 	return img;
 }
 
-void write_image(Image_t * img, const char * const file) {
+void clamp_region(const int full_width, const int full_height, const int x, const int y, const int width, const int height, int * region) {
+	region[0] = min(max(x, 0), full_width - 1);
+	region[1] = min(max(y, 0), full_height - 1);
+	region[2] = (0 < width) ? min(width, full_width - region[0]) : full_width - region[0];
+	region[3] = (0 < height) ? min(height, full_height - region[1]) : full_height - region[1];
+}
+
+// one strip's complete JPEG, from jpeg_mem_dest
+typedef struct EncodedStrip {
+	unsigned char * data;
+	unsigned long size;
+} EncodedStrip_t;
+
+typedef struct ImageWriter {
+	const Image_t * img;
 	FILE * dest;
-	if(NULL == (dest = fopen(file, "wb"))) {
+	jpeg_compress_t c_info;
+	jpeg_error_mgr_t jpg_err;
+	JSAMPARRAY c_buf;
+
+	// strip encoding: rows per strip (0 when encoding serially), the first row not yet
+	// handed to a thread, each strip's output (a deque, so running threads keep their
+	// place as strips are added) and the threads still encoding
+	int strip_rows;
+	int next_row;
+	deque<EncodedStrip_t> strips;
+	deque<thread> encoders;
+
+	// where encoders past the first get their threads (NULL for no limit but encoder_threads),
+	// and how many of the running ones hold a thread from it
+	ThreadBudget_t * budget;
+	int borrowed_threads;
+
+	// a region with a source is composited into it when the writer closes
+	bool composite;
+} ImageWriter_t;
+
+/**
+ * Rows per strip for the parallel encoder, or 0 when the image should be encoded serially
+ */
+static int get_strip_rows(const Image_t *);
+
+/**
+ * Whether the writer may start another strip encoder now, taking a thread from its budget if needed
+ */
+static bool can_start_encoder(ImageWriter_t *);
+
+/**
+ * Waits for the oldest strip encoder, returning its thread to the budget if it held one
+ */
+static void join_encoder(ImageWriter_t *);
+
+/**
+ * Sets up a compressor for rows of the image, with a restart marker after every MCU row if asked
+ */
+static void start_compressor(jpeg_compress_t *, jpeg_error_mgr_t *, const Image_t *, const int, const bool);
+
+/**
+ * Encodes a band of rows as a JPEG of its own in memory, with a restart marker after every MCU row
+ */
+static void encode_strip(const Image_t *, const int, const int, EncodedStrip_t *);
+
+/**
+ * Joins the strips into one JPEG: the first strip's headers (with the full height), each
+ * strip's entropy-coded data separated by the restart marker the single encoder would emit,
+ * and an EOI
+ */
+static void write_strips(ImageWriter_t *);
+
+/**
+ * Offset of the entropy-coded data in an encoded strip, just past its SOS header
+ */
+static size_t get_scan_data_offset(const EncodedStrip_t *);
+
+/**
+ * Writes the image's source with the image pasted in at its region: the iMCUs the region
+ * covers are decoded, patched and re-encoded with the source's own tables, and every other
+ * block's coefficients are copied across without being decoded
+ */
+static void write_composite(ImageWriter_t *);
+
+void write_image(const Image_t * img, const char * const file, ThreadBudget_t * budget) {
+	ImageWriter_t * writer = open_image_writer(img, file, budget);
+	write_rows(writer, img->height);
+	close_image_writer(writer);
+}
+
+struct ImageWriter * open_image_writer(const struct Image * img, const char * const file, ThreadBudget_t * budget) {
+	ImageWriter_t * writer = new ImageWriter_t();
+	writer->img = img;
+	writer->budget = budget;
+	writer->borrowed_threads = 0;
+	if(NULL == (writer->dest = fopen(file, "wb"))) {
 		cout << "unable to open destination file: " << file << endl;
 	}
 
-	// Sync the pixel array with the buffer
-	// sync_buffer(img);
+	// Strips are encoded on their own threads as write_rows finishes them
+	writer->next_row = 0;
+	writer->strip_rows = get_strip_rows(img);
+	if(0 < writer->strip_rows) return writer;
 
-	// Create the compressor structures
-	jpeg_compress_t c_info;
-	jpeg_error_mgr_t jpg_err;
+	// Regions are composited into their source in one go, once every row is done
+#if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
+	writer->composite = (NULL != img->source);
+#else
+	writer->composite = false;
+#endif
+	if(writer->composite) return writer;
 
 	// Init the error handler and the decompressor
-	c_info.err = jpeg_std_error(&jpg_err);
-	jpeg_create_compress(&c_info);
-	jpeg_stdio_dest(&c_info, dest);
+	jpeg_compress_t * c_info = &writer->c_info;
+	start_compressor(c_info, &writer->jpg_err, img, img->height, false);
+	jpeg_stdio_dest(c_info, writer->dest);
+	jpeg_start_compress(c_info, TRUE);
 
-	// Set the img properties
-	c_info.image_width = img->width;
-	c_info.image_height = img->height;
-	c_info.input_components = img->components;
-	c_info.in_color_space = JCS_RGB;
+	// Create a sample row
+	const int c_row_stride = img->width * img->components;
+	writer->c_buf = (c_info->mem->alloc_sarray)((j_common_ptr)c_info, JPOOL_IMAGE, c_row_stride, STRIDES);
 
-	jpeg_set_defaults(&c_info);
-	jpeg_start_compress(&c_info, TRUE);
+	return writer;
+}
+
+void write_rows(struct ImageWriter * writer, const int end_row) {
+	const Image_t * img = writer->img;
+	if(0 < writer->strip_rows) {
+		// hand out every strip whose rows are all done, on as many threads as the budget spares
+		while(writer->next_row < end_row && (end_row == img->height || writer->next_row + writer->strip_rows <= end_row)) {
+			const int rows = min(writer->strip_rows, img->height - writer->next_row);
+			// a joined strip may return its thread to the budget, so ask again after each
+			while(!can_start_encoder(writer)) join_encoder(writer);
+
+			writer->strips.push_back(EncodedStrip_t());
+			writer->encoders.push_back(thread(encode_strip, img, writer->next_row, rows, &writer->strips.back()));
+			writer->next_row += rows;
+		}
+		return;
+	}
+	if(writer->composite) return;
+
+	jpeg_compress_t * c_info = &writer->c_info;
 
-	// Create a sample row
 	const int c_row_stride = img->width * img->components;
-	JSAMPARRAY c_buf = (c_info.mem->alloc_sarray)((j_common_ptr)&c_info, JPOOL_IMAGE, c_row_stride, STRIDES);
+	const int budget_rows = get_rows_per_budget(img);
+	for(int counter = c_info->next_scanline; counter < end_row; ++counter) {
+		memcpy(*writer->c_buf, img->buffer + ((size_t)counter * c_row_stride), c_row_stride);
+		jpeg_write_scanlines(c_info, writer->c_buf, STRIDES);
+		if(budget_rows < img->height && 0 == (counter + 1) % budget_rows) {
+			evict_scratch_pages(img->buffer + ((size_t)(counter + 1 - budget_rows) * c_row_stride), (size_t)budget_rows * c_row_stride);
+		}
+	}
+}
 
-	for(int counter = 0; c_info.next_scanline < (unsigned int)img->height; ++counter) {
-		memcpy(*c_buf, img->buffer + (counter * img->width * img->components), c_row_stride);
-		jpeg_write_scanlines(&c_info, c_buf, STRIDES);
+void close_image_writer(struct ImageWriter * writer) {
+	if(0 < writer->strip_rows) {
+		while(!writer->encoders.empty()) join_encoder(writer);
+		write_strips(writer);
+	} else if(writer->composite) {
+		write_composite(writer);
+	} else {
+		jpeg_finish_compress(&writer->c_info);
+		jpeg_destroy_compress(&writer->c_info);
 	}
+	fclose(writer->dest);
+	delete writer;
+}
 
-	jpeg_finish_compress(&c_info);
-	jpeg_destroy_compress(&c_info);
-	fclose(dest);
+void set_encoder_threads(const int threads) {
+	encoder_threads = (0 < threads) ? threads : max(1u, thread::hardware_concurrency());
+}
+
+struct ThreadBudget * create_thread_budget(const int threads) {
+	ThreadBudget_t * budget = new ThreadBudget_t();
+	budget->idle_threads = threads;
+	return budget;
+}
+
+void destroy_thread_budget(struct ThreadBudget * budget) {
+	delete budget;
+}
 
-	delete[] img->buffer;
-	delete img;
+bool try_acquire_thread(struct ThreadBudget * budget) {
+	if(0 < budget->idle_threads--) return true;
+	++budget->idle_threads;
+	return false;
+}
+
+void release_thread(struct ThreadBudget * budget) {
+	++budget->idle_threads;
+}
+
+size_t count_differing_encoded_bytes(const struct Image * img, const char * const file) {
+	if(0 == get_strip_rows(img)) return 0;
+
+	// the single-threaded encoder, restarting after every MCU row as the strips do
+	EncodedStrip_t expected;
+	encode_strip(img, 0, img->height, &expected);
+
+	FILE * src = fopen(file, "rb");
+	if(NULL == src) {
+		cout << "unable to open encoded file: " << file << endl;
+		free(expected.data);
+		return expected.size;
+	}
+
+	size_t differing = 0, position = 0;
+	for(int byte = fgetc(src); EOF != byte; byte = fgetc(src), ++position) {
+		if(position >= expected.size || expected.data[position] != byte) ++differing;
+	}
+	if(position < expected.size) differing += expected.size - position;
+	fclose(src);
+	free(expected.data);
+	return differing;
+}
+
+struct Image * create_image(struct BufferPool * pool, unsigned char * buffer, const int width, const int height, const int components) {
+	Image_t * img = (Image_t*)malloc(sizeof(Image_t));
+	img->buffer = buffer;
+	img->width = width;
+	img->height = height;
+	img->components = components;
+	img->pool = pool;
+	img->source = NULL;
+	return img;
+}
+
+struct Image * copy_image(const struct Image * src) {
+	Image_t * img = (Image_t*)malloc(sizeof(Image_t));
+	*img = *src;
+	img->buffer = acquire_buffer(src->pool, get_buffer_size(src));
+	memcpy(img->buffer, src->buffer, get_buffer_size(src));
+	return img;
+}
+
+struct Image * copy_image_from_snapshot(const struct Image * src, const struct Snapshot * snapshot) {
+	Image_t * img = (Image_t*)malloc(sizeof(Image_t));
+	*img = *src;
+	img->buffer = acquire_snapshot_buffer(src->pool, snapshot);
+	return img;
+}
+
+size_t count_differing_bytes(const struct Image * a, const struct Image * b) {
+	assert(get_buffer_size(a) == get_buffer_size(b));
+	size_t differing = 0;
+	for(size_t i = 0, l = get_buffer_size(a); i < l; ++i) {
+		if(a->buffer[i] != b->buffer[i]) ++differing;
+	}
+	return differing;
+}
+
+void destroy_image(struct Image * img) {
+	release_buffer(img->pool, img->buffer);
+	free(img);
 }
 
 int get_width(const struct Image * const img) {
@@ -131,11 +435,245 @@ int get_components(const struct Image * const img) {
 	return img->components;
 }
 
+struct BufferPool * get_buffer_pool(const struct Image * const img) {
+	return img->pool;
+}
+
 const unsigned char * const get_buffer(const struct Image * const img) {
 	return img->buffer;
 }
 
-void set_buffer(struct Image * img, unsigned char * buffer) {
-	free(img->buffer);
-	img->buffer = buffer;
+unsigned char * get_writable_buffer(struct Image * img) {
+	return img->buffer;
+}
+
+int get_strip_rows(const Image_t * img) {
+#if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
+	if(NULL != img->source) return 0;
+	if(1 >= encoder_threads) return 0;
+
+	// the tallest component sampling sets the MCU height
+	jpeg_compress_t c_info;
+	jpeg_error_mgr_t jpg_err;
+	start_compressor(&c_info, &jpg_err, img, img->height, true);
+	int max_v_samp = 1;
+	for(int c = 0; c < c_info.num_components; ++c) max_v_samp = max(max_v_samp, c_info.comp_info[c].v_samp_factor);
+	jpeg_destroy_compress(&c_info);
+
+	// a few strips per thread, so they can start while the sort is still finishing rows
+	const int alignment = RESTART_MARKER_CYCLE * DCTSIZE * max_v_samp;
+	const int strip_rows = max(alignment, ((img->height / (STRIPS_PER_THREAD * encoder_threads)) / alignment) * alignment);
+	return (strip_rows < img->height) ? strip_rows : 0;
+#else
+	return 0;
+#endif
+}
+
+bool can_start_encoder(ImageWriter_t * writer) {
+	// the first encoder runs on the thread the caller set aside for encoding
+	const size_t running = writer->encoders.size();
+	if(0 == running) return true;
+	if(running >= (size_t)encoder_threads) return false;
+	if(NULL == writer->budget) return true;
+	if(!try_acquire_thread(writer->budget)) return false;
+	++writer->borrowed_threads;
+	return true;
+}
+
+void join_encoder(ImageWriter_t * writer) {
+	writer->encoders.front().join();
+	writer->encoders.pop_front();
+	if(writer->borrowed_threads >= (int)writer->encoders.size() && 0 < writer->borrowed_threads) {
+		--writer->borrowed_threads;
+		release_thread(writer->budget);
+	}
+}
+
+void start_compressor(jpeg_compress_t * c_info, jpeg_error_mgr_t * jpg_err, const Image_t * img, const int height, const bool restart) {
+	c_info->err = jpeg_std_error(jpg_err);
+	jpeg_create_compress(c_info);
+
+	// Set the img properties
+	c_info->image_width = img->width;
+	c_info->image_height = height;
+	c_info->input_components = img->components;
+	c_info->in_color_space = JCS_RGB;
+
+	jpeg_set_defaults(c_info);
+	if(restart) c_info->restart_in_rows = 1;
+}
+
+void encode_strip(const Image_t * img, const int first_row, const int rows, EncodedStrip_t * strip) {
+#if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
+	jpeg_compress_t c_info;
+	jpeg_error_mgr_t jpg_err;
+	start_compressor(&c_info, &jpg_err, img, rows, true);
+	strip->data = NULL;
+	strip->size = 0;
+	jpeg_mem_dest(&c_info, &strip->data, &strip->size);
+	jpeg_start_compress(&c_info, TRUE);
+
+	// rows are handed to the compressor straight from the image buffer
+	const size_t row_stride = (size_t)img->width * img->components;
+	for(int row = first_row; row < first_row + rows; ++row) {
+		JSAMPROW row_pointer = img->buffer + (row * row_stride);
+		jpeg_write_scanlines(&c_info, &row_pointer, STRIDES);
+	}
+	jpeg_finish_compress(&c_info);
+	jpeg_destroy_compress(&c_info);
+
+	if(NULL != get_pool_scratch_space(img->pool)) {
+		evict_scratch_pages(img->buffer + (first_row * row_stride), rows * row_stride);
+	}
+#endif
+}
+
+void write_strips(ImageWriter_t * writer) {
+	const Image_t * img = writer->img;
+	for(size_t idx = 0; idx < writer->strips.size(); ++idx) {
+		EncodedStrip_t * strip = &writer->strips[idx];
+		const size_t data_offset = get_scan_data_offset(strip);
+
+		if(0 == idx) {
+			// the headers, with the frame's height patched from the strip's to the image's
+			for(size_t pos = 2; pos + 4 < data_offset; pos += 2 + ((strip->data[pos + 2] << 8) | strip->data[pos + 3])) {
+				if(JPEG_MARKER == strip->data[pos] && SOF0_MARKER == strip->data[pos + 1]) {
+					strip->data[pos + 5] = (img->height >> 8) & 0xFF;
+					strip->data[pos + 6] = img->height & 0xFF;
+				}
+			}
+			fwrite(strip->data, 1, data_offset, writer->dest);
+		} else {
+			// the previous strip ended on a whole cycle of MCU rows, so the single encoder's
+			// marker here is always the last in the cycle
+			const unsigned char restart[2] = { JPEG_MARKER, (unsigned char)(RST0_MARKER + RESTART_MARKER_CYCLE - 1) };
+			fwrite(restart, 1, sizeof(restart), writer->dest);
+		}
+
+		// everything up to the strip's own EOI
+		fwrite(strip->data + data_offset, 1, strip->size - 2 - data_offset, writer->dest);
+		free(strip->data);
+	}
+
+	const unsigned char end[2] = { JPEG_MARKER, EOI_MARKER };
+	fwrite(end, 1, sizeof(end), writer->dest);
+}
+
+size_t get_scan_data_offset(const EncodedStrip_t * strip) {
+	// markers after the SOI each carry a big-endian length that includes itself
+	size_t pos = 2;
+	while(pos + 4 <= strip->size && !(JPEG_MARKER == strip->data[pos] && SOS_MARKER == strip->data[pos + 1])) {
+		pos += 2 + ((strip->data[pos + 2] << 8) | strip->data[pos + 3]);
+	}
+	assert(pos + 4 <= strip->size);
+	return pos + 2 + ((strip->data[pos + 2] << 8) | strip->data[pos + 3]);
+}
+
+void write_composite(ImageWriter_t * writer) {
+#if JPEG_LIB_VERSION >= 80 || defined(MEM_SRCDST_SUPPORTED)
+	const Image_t * img = writer->img;
+	FILE * src;
+	if(NULL == (src = fopen(img->source, "rb"))) {
+		cout << "unable to open source file: " << img->source << endl;
+		exit(1);
+	}
+
+	jpeg_decompress_t d_info;
+	jpeg_error_mgr_t d_err;
+	d_info.err = jpeg_std_error(&d_err);
+	jpeg_create_decompress(&d_info);
+	jpeg_stdio_src(&d_info, src);
+	jpeg_read_header(&d_info, TRUE);
+	if(JCS_YCbCr != d_info.jpeg_color_space || img->components != d_info.num_components) {
+		cout << "unable to composite a region into " << img->source << ": only YCbCr sources are supported" << endl;
+		exit(1);
+	}
+	jvirt_barray_ptr * coefficients = jpeg_read_coefficients(&d_info);
+
+	// the region, widened to whole iMCUs so its blocks line up with the source's
+	int region[4];
+	clamp_region(d_info.image_width, d_info.image_height, img->source_x, img->source_y, img->width, img->height, region);
+	assert(region[2] == img->width && region[3] == img->height);
+	const int imcu_width = d_info.max_h_samp_factor * DCTSIZE, imcu_height = d_info.max_v_samp_factor * DCTSIZE;
+	const int left = (region[0] / imcu_width) * imcu_width, top = (region[1] / imcu_height) * imcu_height;
+	const int right = min((int)d_info.image_width, ((region[0] + region[2] + imcu_width - 1) / imcu_width) * imcu_width);
+	const int bottom = min((int)d_info.image_height, ((region[1] + region[3] + imcu_height - 1) / imcu_height) * imcu_height);
+
+	// the widened region's pixels, with the sorted ones pasted over the middle
+	Image_t * patch = decode_region(img->source, img->pool, left, top, right - left, bottom - top);
+	const size_t row_stride = (size_t)img->width * img->components, patch_stride = (size_t)patch->width * patch->components;
+	for(int row = 0; row < img->height; ++row) {
+		memcpy(patch->buffer + ((size_t)(region[1] - top + row) * patch_stride) + ((region[0] - left) * patch->components), img->buffer + (row * row_stride), row_stride);
+	}
+
+	// encoded with the source's tables and sampling, then read back as coefficients
+	jpeg_compress_t c_info;
+	jpeg_error_mgr_t c_err;
+	c_info.err = jpeg_std_error(&c_err);
+	jpeg_create_compress(&c_info);
+	jpeg_copy_critical_parameters(&d_info, &c_info);
+	c_info.image_width = patch->width;
+	c_info.image_height = patch->height;
+	c_info.input_components = patch->components;
+	c_info.in_color_space = JCS_RGB;
+	unsigned char * patch_data = NULL;
+	unsigned long patch_size = 0;
+	jpeg_mem_dest(&c_info, &patch_data, &patch_size);
+	jpeg_start_compress(&c_info, TRUE);
+	for(int row = 0; row < patch->height; ++row) {
+		JSAMPROW row_pointer = patch->buffer + (row * patch_stride);
+		jpeg_write_scanlines(&c_info, &row_pointer, STRIDES);
+	}
+	jpeg_finish_compress(&c_info);
+	jpeg_destroy_compress(&c_info);
+	destroy_image(patch);
+
+	jpeg_decompress_t p_info;
+	jpeg_error_mgr_t p_err;
+	p_info.err = jpeg_std_error(&p_err);
+	jpeg_create_decompress(&p_info);
+	jpeg_mem_src(&p_info, patch_data, patch_size);
+	jpeg_read_header(&p_info, TRUE);
+	jvirt_barray_ptr * patch_coefficients = jpeg_read_coefficients(&p_info);
+
+	// the patch's blocks replace the source's, row by row in each component
+	for(int c = 0; c < d_info.num_components; ++c) {
+		const jpeg_component_info * comp = d_info.comp_info + c, * patch_comp = p_info.comp_info + c;
+		const JDIMENSION block_col = (left / imcu_width) * comp->h_samp_factor, block_row = (top / imcu_height) * comp->v_samp_factor;
+		const JDIMENSION cols = min(patch_comp->width_in_blocks, comp->width_in_blocks - block_col);
+		for(JDIMENSION row = 0; row < patch_comp->height_in_blocks && block_row + row < comp->height_in_blocks; ++row) {
+			JBLOCKARRAY from = (*p_info.mem->access_virt_barray)((j_common_ptr)&p_info, patch_coefficients[c], row, 1, FALSE);
+			JBLOCKARRAY to = (*d_info.mem->access_virt_barray)((j_common_ptr)&d_info, coefficients[c], block_row + row, 1, TRUE);
+			memcpy(to[0] + block_col, from[0], cols * sizeof(JBLOCK));
+		}
+	}
+	jpeg_finish_decompress(&p_info);
+	jpeg_destroy_decompress(&p_info);
+	free(patch_data);
+
+	// everything else is the source's own coefficients, written back without decoding them
+	jpeg_compress_t * out = &writer->c_info;
+	out->err = jpeg_std_error(&writer->jpg_err);
+	jpeg_create_compress(out);
+	jpeg_copy_critical_parameters(&d_info, out);
+	jpeg_stdio_dest(out, writer->dest);
+	jpeg_write_coefficients(out, coefficients);
+	jpeg_finish_compress(out);
+	jpeg_destroy_compress(out);
+
+	jpeg_finish_decompress(&d_info);
+	jpeg_destroy_decompress(&d_info);
+	fclose(src);
+#endif
+}
+
+size_t get_buffer_size(const Image_t * img) {
+	return (size_t)img->width * img->height * img->components;
+}
+
+int get_rows_per_budget(const Image_t * img) {
+	const struct ScratchSpace * scratch = get_pool_scratch_space(img->pool);
+	if(NULL == scratch) return img->height;
+	const size_t rows = get_memory_budget(scratch) / ((size_t)img->width * img->components);
+	return 0 < rows ? (int)rows : 1;
 }
@@ -0,0 +1,292 @@
+#include "../include/reference.h"
+
+#include <vector>
+#include <algorithm>
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#define COMPONENTS 3
+#define HSV_BITS 5
+
+// AUTO thresholds for byte keys fall on any key; MUL keys (up to 24 bits) fall on
+// multiples of 1 << MUL_THRESHOLD_SHIFT
+#define BYTE_KEY_RANGE 256
+#define MUL_THRESHOLD_SHIFT 8
+#define MUL_THRESHOLD_STEPS (1 << 16)
+
+using namespace std;
+
+typedef struct PixelSortQuery PixelSortQuery_t;
+
+typedef struct Pixel {
+	unsigned char r;
+	unsigned char g;
+	unsigned char b;
+} Pixel_t;
+
+// everything one subquery needs, straight from the query
+typedef struct ReferencePlan {
+	int run_count;
+	int run_length;
+	bool is_ascending;
+	Comparison_e comparison;
+	RunType_e run_type;
+	long threshold;
+	Operation_e operation;
+	long operation_param;
+} ReferencePlan_t;
+
+/**
+ * Runs a block's steps as many times as it repeats, returning the pixels changed over all passes
+ */
+static long run_block(struct Image *, const PixelSortQuery_t *, const int);
+
+/**
+ * Runs a single subquery, returning the pixels it changed
+ */
+static long run_subquery(struct Image *, const PixelSortQuery_t *, const int);
+
+/**
+ * Finds the runs of a line and arranges each of them
+ */
+static void process_line(Pixel_t *, const ReferencePlan_t *);
+
+/**
+ * Whether a pixel belongs in a DARK or LIGHT run
+ */
+static bool in_run(const Pixel_t *, const ReferencePlan_t *);
+
+/**
+ * Sorts, partitions or takes the top of one run, from a stable sort of its positions
+ */
+static void arrange_run(Pixel_t *, const int, const ReferencePlan_t *);
+
+/**
+ * The threshold an AUTO subquery runs with, from every key in the image in order
+ */
+static long get_auto_threshold(const struct Image *, const PixelSortQuery_t *, const int);
+
+/**
+ * The pixel's key, computed from its channels alone
+ */
+static int get_key(const Pixel_t *, Comparison_e);
+
+/**
+ * HSV hue (0) or saturation (1) of a colour, scaled to 0-255, after quantizing each
+ * channel to the centre of its HSV_BITS bin
+ */
+static int get_hsv_key(const Pixel_t *, const int);
+
+void reference_sort_steps(struct Image * img, const PixelSortQuery_t * query, const int first_step, const int end_step) {
+	for(int step = first_step; step < end_step; ++step) {
+		const int idx = get_step_index(query, 0, step);
+		if(is_block_step(query, 0, step)) {
+			run_block(img, query, idx);
+		} else {
+			run_subquery(img, query, idx);
+		}
+	}
+}
+
+long run_block(struct Image * img, const PixelSortQuery_t * query, const int block_idx) {
+	const long repeat_count = get_repeat_count(query, block_idx);
+	const size_t bytes = (size_t)get_width(img) * get_height(img) * get_components(img);
+	long changed = 0;
+	for(long pass = 0; pass < repeat_count; ++pass) {
+		// a pass is stable when it leaves the image as it found it
+		const vector<unsigned char> before(get_buffer(img), get_buffer(img) + bytes);
+		long pass_changed = 0;
+		for(int step = 0, l = get_block_step_count(query, block_idx); step < l; ++step) {
+			const int idx = get_step_index(query, block_idx, step);
+			pass_changed += is_block_step(query, block_idx, step) ? run_block(img, query, idx) : run_subquery(img, query, idx);
+		}
+		changed += pass_changed;
+		if(is_until_stable(query, block_idx) && 0 == memcmp(before.data(), get_buffer(img), bytes)) break;
+	}
+	return changed;
+}
+
+long run_subquery(struct Image * img, const PixelSortQuery_t * query, const int subquery_idx) {
+	const int width = get_width(img), height = get_height(img);
+	assert(COMPONENTS == get_components(img));
+
+	ReferencePlan_t plan;
+	const Orientation_e orientation = get_orientation(query, subquery_idx);
+	plan.run_length = (ROW == orientation) ? width : height;
+	plan.run_count = (ROW == orientation) ? height : width;
+	plan.is_ascending = (ASC == get_sort_direction(query, subquery_idx));
+	plan.comparison = get_comparison(query, subquery_idx);
+	plan.run_type = get_run_type(query, subquery_idx);
+	plan.threshold = is_auto_threshold(query, subquery_idx) ? get_auto_threshold(img, query, subquery_idx) : get_run_threshold(query, subquery_idx);
+	plan.operation = get_operation(query, subquery_idx);
+	plan.operation_param = get_operation_param(query, subquery_idx);
+
+	// the lines laid end to end, columns transposed one pixel at a time
+	const Pixel_t * image = (const Pixel_t *)get_buffer(img);
+	vector<Pixel_t> lines((size_t)width * height);
+	for(int y = 0; y < height; ++y) {
+		for(int x = 0; x < width; ++x) {
+			const size_t line_idx = (ROW == orientation) ? ((size_t)y * width) + x : ((size_t)x * height) + y;
+			lines[line_idx] = image[((size_t)y * width) + x];
+		}
+	}
+
+	for(int line = 0; line < plan.run_count; ++line) {
+		process_line(lines.data() + ((size_t)line * plan.run_length), &plan);
+	}
+
+	long changed = 0;
+	Pixel_t * pixels = (Pixel_t *)get_writable_buffer(img);
+	for(int y = 0; y < height; ++y) {
+		for(int x = 0; x < width; ++x) {
+			const size_t line_idx = (ROW == orientation) ? ((size_t)y * width) + x : ((size_t)x * height) + y;
+			Pixel_t * pixel = pixels + ((size_t)y * width) + x;
+			if(0 != memcmp(pixel, &lines[line_idx], sizeof(Pixel_t))) ++changed;
+			*pixel = lines[line_idx];
+		}
+	}
+	return changed;
+}
+
+void process_line(Pixel_t * line, const ReferencePlan_t * plan) {
+	const int length = plan->run_length;
+	switch(plan->run_type) {
+		case FULL:
+			arrange_run(line, length, plan);
+			break;
+		case FIXED:
+			for(int start = 0; start < length; start += plan->threshold) {
+				arrange_run(line + start, min((long)length - start, plan->threshold), plan);
+			}
+			break;
+		case DARK:
+		case LIGHT:
+		default:
+			// each longest stretch of pixels on the run side of the threshold is a run
+			for(int start = 0; start < length; ) {
+				if(!in_run(line + start, plan)) {
+					++start;
+					continue;
+				}
+				int end = start;
+				while(end < length && in_run(line + end, plan)) ++end;
+				arrange_run(line + start, end - start, plan);
+				start = end;
+			}
+			break;
+	}
+}
+
+bool in_run(const Pixel_t * pixel, const ReferencePlan_t * plan) {
+	const int key = get_key(pixel, plan->comparison);
+	return (DARK == plan->run_type) ? key > plan->threshold : key < plan->threshold;
+}
+
+void arrange_run(Pixel_t * run, const int length, const ReferencePlan_t * plan) {
+	if(0 == length) return;
+
+	vector<Pixel_t> original(run, run + length);
+	vector<int> keys(length), order(length);
+	for(int idx = 0; idx < length; ++idx) {
+		keys[idx] = get_key(run + idx, plan->comparison);
+		order[idx] = idx;
+	}
+
+	// where each pixel would go in a full sort; equal keys keep their order
+	const bool ascending = plan->is_ascending;
+	stable_sort(order.begin(), order.end(), [&keys, ascending](const int a, const int b) {
+		return ascending ? keys[a] < keys[b] : keys[b] < keys[a];
+	});
+
+	vector<int> arranged;
+	if(SORT == plan->operation) {
+		arranged = order;
+	} else if(PARTITION == plan->operation) {
+		// the pixels that sort before the percentile's pixel, then its ties, then the rest, each in their original order
+		const int pivot = keys[order[((long)(length - 1) * plan->operation_param) / 100]];
+		for(int side = -1; side <= 1; ++side) {
+			for(int idx = 0; idx < length; ++idx) {
+				const int before = ascending ? pivot - keys[idx] : keys[idx] - pivot;
+				if((0 < before ? -1 : (0 > before ? 1 : 0)) == side) arranged.push_back(idx);
+			}
+		}
+	} else {
+		// the last k positions of the full sort go to the end in that order, the rest keep theirs
+		const int count = (int)min((long)length, plan->operation_param);
+		vector<bool> is_top(length, false);
+		for(int rank = length - count; rank < length; ++rank) is_top[order[rank]] = true;
+		for(int idx = 0; idx < length; ++idx) {
+			if(!is_top[idx]) arranged.push_back(idx);
+		}
+		arranged.insert(arranged.end(), order.begin() + (length - count), order.end());
+	}
+
+	for(int idx = 0; idx < length; ++idx) {
+		run[idx] = original[arranged[idx]];
+	}
+}
+
+long get_auto_threshold(const struct Image * img, const PixelSortQuery_t * query, const int subquery_idx) {
+	const Comparison_e comparison = get_comparison(query, subquery_idx);
+	const Pixel_t * pixels = (const Pixel_t *)get_buffer(img);
+	const size_t pixel_count = (size_t)get_width(img) * get_height(img);
+	vector<int> keys(pixel_count);
+	for(size_t idx = 0; idx < pixel_count; ++idx) keys[idx] = get_key(pixels + idx, comparison);
+	sort(keys.begin(), keys.end());
+
+	// candidate thresholds step through the key range, and the last that keeps the runs
+	// within the percentage wins; DARK runs are the keys above it, LIGHT runs those below
+	const int shift = (MUL == comparison) ? MUL_THRESHOLD_SHIFT : 0;
+	const long steps = (MUL == comparison) ? MUL_THRESHOLD_STEPS : BYTE_KEY_RANGE;
+	const long target = (long)((pixel_count * get_run_threshold(query, subquery_idx)) / 100);
+	if(DARK == get_run_type(query, subquery_idx)) {
+		for(long step = 0; ; ++step) {
+			const long threshold = (step << shift) - 1;
+			if(target >= keys.end() - upper_bound(keys.begin(), keys.end(), threshold)) return threshold;
+		}
+	}
+
+	long step = 0;
+	while(steps > step && target >= lower_bound(keys.begin(), keys.end(), (step + 1) << shift) - keys.begin()) ++step;
+	return step << shift;
+}
+
+int get_key(const Pixel_t * pixel, Comparison_e comparison) {
+	const int r = pixel->r, g = pixel->g, b = pixel->b;
+	switch(comparison) {
+		case AVG: return (r + g + b) / COMPONENTS;
+		case MUL: return r * g * b;
+		case MAX: return max(r, max(g, b));
+		case MIN: return min(r, min(g, b));
+		case LUMA: {
+			// Rec.709 weights in 16.16 fixed point, each product truncated, rounded at the end
+			const int luma = (int)(0.2126 * r * 65536.0) + (int)(0.7152 * g * 65536.0) + (int)(0.0722 * b * 65536.0);
+			return (luma + 0x8000) >> 16;
+		}
+		case HUE: return get_hsv_key(pixel, 0);
+		case SATURATION: return get_hsv_key(pixel, 1);
+		case XOR:
+		default: return r ^ g ^ b;
+	}
+}
+
+int get_hsv_key(const Pixel_t * pixel, const int which) {
+	const int drop = 8 - HSV_BITS, half_bin = 1 << (7 - HSV_BITS);
+	const int r = ((pixel->r >> drop) << drop) + half_bin;
+	const int g = ((pixel->g >> drop) << drop) + half_bin;
+	const int b = ((pixel->b >> drop) << drop) + half_bin;
+	const int max_channel = max(r, max(g, b)), min_channel = min(r, min(g, b));
+	const int delta = max_channel - min_channel;
+	if(1 == which) return (0 < max_channel) ? (255 * delta) / max_channel : 0;
+
+	double hue = 0.0;
+	if(0 < delta) {
+		if(max_channel == r) hue = (double)(g - b) / delta;
+		else if(max_channel == g) hue = 2.0 + (double)(b - r) / delta;
+		else hue = 4.0 + (double)(r - g) / delta;
+		if(0.0 > hue) hue += 6.0;
+	}
+	return (int)(hue * 256.0 / 6.0);
+}
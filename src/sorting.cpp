@@ -1,11 +1,60 @@
 #include "../include/read_write.h"
 #include "../include/parser.h"
+#include "../include/storage.h"
+#include "../include/sorting.h"
+#include "../include/reference.h"
+
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <cassert>
+#include <cstdint>
+
+#include <unistd.h>
 
 #define COMPONENTS 3
+#define HSV_BITS 5
+#define TILE_SIZE 64
+#define FAULT_AROUND_BYTES (64 << 10)
+#define ROWS_PER_PROGRESS 16
+
+// run lengths where the optimized engine switches sorting strategy; override at build
+// time with -D, or measure on the running machine with autotune_sort_cutoffs
+#ifndef NETWORK_SORT_MAX_RUN
+#define NETWORK_SORT_MAX_RUN 8
+#endif
+#ifndef COUNTING_SORT_MIN_RUN
+#define COUNTING_SORT_MIN_RUN 32
+#endif
+
+#define BYTE_KEY_RANGE 256
+#define WIDE_KEY_BITS 24
+#define HISTOGRAM_BITS 16
+#define HISTOGRAM_BLOCK 256
+#define AUTOTUNE_PIXELS (1 << 18)
+#define AUTOTUNE_ROUNDS 3
+#define AUTOTUNE_STEP 12
+
+// the longest run a sorting network handles, padded to 4 or 8 words
+#define NETWORK_SORT_LIMIT 8
+static_assert(NETWORK_SORT_MAX_RUN <= NETWORK_SORT_LIMIT, "NETWORK_SORT_MAX_RUN is longer than the longest sorting network");
+
+// Batcher's odd-even merge sort networks; constant positions let the words live in registers
+#define COMPARE_EXCHANGE(w, i, j) { const uint64_t low = std::min(w[i], w[j]); w[j] = std::max(w[i], w[j]); w[i] = low; }
+#define NETWORK_4(w) \
+	COMPARE_EXCHANGE(w, 0, 1) COMPARE_EXCHANGE(w, 2, 3) COMPARE_EXCHANGE(w, 0, 2) \
+	COMPARE_EXCHANGE(w, 1, 3) COMPARE_EXCHANGE(w, 1, 2)
+#define NETWORK_8(w) \
+	COMPARE_EXCHANGE(w, 0, 1) COMPARE_EXCHANGE(w, 2, 3) COMPARE_EXCHANGE(w, 4, 5) COMPARE_EXCHANGE(w, 6, 7) \
+	COMPARE_EXCHANGE(w, 0, 2) COMPARE_EXCHANGE(w, 1, 3) COMPARE_EXCHANGE(w, 4, 6) COMPARE_EXCHANGE(w, 5, 7) \
+	COMPARE_EXCHANGE(w, 1, 2) COMPARE_EXCHANGE(w, 5, 6) COMPARE_EXCHANGE(w, 0, 4) COMPARE_EXCHANGE(w, 1, 5) \
+	COMPARE_EXCHANGE(w, 2, 6) COMPARE_EXCHANGE(w, 3, 7) COMPARE_EXCHANGE(w, 2, 4) COMPARE_EXCHANGE(w, 3, 5) \
+	COMPARE_EXCHANGE(w, 1, 2) COMPARE_EXCHANGE(w, 3, 4) COMPARE_EXCHANGE(w, 5, 6)
 
 #define CMP_FN inline int
 #define VAL_FN inline int
@@ -15,33 +64,43 @@
 #define MAX_VAL max_val
 #define MIN_VAL min_val
 #define XOR_VAL orx_val
+#define LUMA_VAL luma_val
+#define HUE_VAL hue_val
+#define SAT_VAL sat_val
 
 #define AVG_CMP avg_cmp
 #define MUL_CMP mul_cmp
 #define MAX_CMP max_cmp
 #define MIN_CMP min_cmp
 #define XOR_CMP orx_cmp
+#define LUMA_CMP luma_cmp
+#define HUE_CMP hue_cmp
+#define SAT_CMP sat_cmp
 
 #define NOT_AVG_CMP n_avg_cmp
 #define NOT_MUL_CMP n_mul_cmp
 #define NOT_MAX_CMP n_max_cmp
 #define NOT_MIN_CMP n_min_cmp
 #define NOT_XOR_CMP n_orx_cmp
+#define NOT_LUMA_CMP n_luma_cmp
+#define NOT_HUE_CMP n_hue_cmp
+#define NOT_SAT_CMP n_sat_cmp
 
 struct SortPlan;
 
 typedef struct PixelSortQuery PixelSortQuery_t;
 
 typedef struct Pixel {
-	const unsigned char r;
-	const unsigned char g; 
-	const unsigned char b; 
+	unsigned char r;
+	unsigned char g; 
+	unsigned char b; 
 } Pixel_t;
 
 // Sorting Function Typedefs
 typedef int(*sort_val_fn_t)(const Pixel_t *);
 typedef int(*compare_fn_t)(const Pixel_t *, const Pixel_t *);
-typedef void(*run_processor_fn_t)(Pixel_t *, const struct SortPlan *);
+typedef long(*run_processor_fn_t)(Pixel_t *, const struct SortPlan *);
+typedef void(*arrange_fn_t)(Pixel_t *, const int, const struct SortPlan *);
 
 struct SortPlan;
 
@@ -52,20 +111,110 @@ typedef struct SortPlan {
 	long threshold;
 
 	Orientation_e orientation;
+	struct BufferPool * pool;
+	struct ScratchSpace * scratch;
 
 	run_processor_fn_t run_processor_fn;	
 	sort_val_fn_t sort_val_fn;
 	compare_fn_t compare_fn;
+
+	// what is done to each run (sort, partition or top-k), and its percentile or pixel count
+	arrange_fn_t arrange_fn;
+	long operation_param;
+
+	// holds each run's pixels before sorting, to find the ones that moved
+	Pixel_t * run_copy;
+
+	// each run's keys, negated for descending sorts, and the (key, position) pairs that
+	// order them; keys below key_range (zero when they can exceed a byte) can be counted
+	int * run_keys;
+	uint64_t * run_order;
+	int key_range;
+
+	// dirty flags for this plan's lines, and for the lines crossing them
+	bool skip_clean_lines;
+	std::vector<bool> * line_dirty;
+	std::vector<bool> * cross_dirty;
+
+	rows_done_fn_t rows_done_fn;
+	void * rows_done_ctx;
 } SortPlan_t;
 
+// Which lines (rows or columns) changed since they were last sorted, and how they were sorted
+typedef struct LineState {
+	bool has_layout;
+	run_processor_fn_t run_processor_fn;
+	compare_fn_t compare_fn;
+	long threshold;
+	arrange_fn_t arrange_fn;
+	long operation_param;
+	std::vector<bool> dirty;
+} LineState_t;
+
+// Carried across the subqueries of one sort; lines are indexed by Orientation_e, and
+// auto thresholds by subquery (negative until first needed)
+typedef struct SortState {
+	LineState_t lines[2];
+	std::vector<long> auto_thresholds;
+} SortState_t;
+
 // Sorter
-void sort_run(Pixel_t *, const int, compare_fn_t);
+long sort_run(Pixel_t *, const int, const SortPlan_t *, const int);
+int is_sorted_run(const Pixel_t *, const int, compare_fn_t);
+
+// Run Arrangers; each rebuilds a run from the plan's copy of it
+void sort_arranger(Pixel_t *, const int, const SortPlan_t *);
+void partition_arranger(Pixel_t *, const int, const SortPlan_t *);
+void top_arranger(Pixel_t *, const int, const SortPlan_t *);
+
+// Sorting Strategies, picked by run length and key range; all sort the run's keys
+// ascending, and all are stable
+void network_sort_run(Pixel_t *, const int, const SortPlan_t *);
+void counting_sort_run(Pixel_t *, const int, const SortPlan_t *);
+void key_sort_run(Pixel_t *, const int, const SortPlan_t *);
+
+/**
+ * Packs a key and its position into one word that orders by key, then position
+ */
+static inline uint64_t get_order_word(const int, const int);
+
+static int network_sort_max_run = NETWORK_SORT_MAX_RUN;
+static int counting_sort_min_run = COUNTING_SORT_MIN_RUN;
+
+/**
+ * Times a strategy sorting runs of the given length from a pool of wandering pixels, in ns per
+ * run; the best of a few rounds, to ride out interruptions
+ */
+static double time_strategy(arrange_fn_t, const Pixel_t *, const int, SortPlan_t *, Pixel_t *);
+
+/**
+ * Picks the DARK or LIGHT threshold that puts the subquery's percentage of the image's
+ * pixels in runs, from a histogram of its key over the whole image
+ */
+static long get_auto_threshold(const struct Image *, const PixelSortQuery_t *, const int, const SortPlan_t *);
+
+/**
+ * Adds the keys of a range of pixels to a histogram, with bins of 1 << shift keys, a
+ * budget's worth at a time; one of these runs on each thread
+ */
+static void histogram_range(const Pixel_t *, const size_t, const size_t, Comparison_e, const int, long *, struct ScratchSpace *);
+
+/**
+ * Histograms a block of pixels, computing the keys in a loop of their own so it vectorizes
+ */
+template<int (*VAL)(const Pixel_t *)> static void histogram_block(const Pixel_t *, const int, const int, long *);
+
+/**
+ * The pixel a full sort would put at the given rank, found by selection; scrambles the run,
+ * which is rebuilt afterwards
+ */
+static Pixel_t select_rank(Pixel_t *, const int, const int, const SortPlan_t *);
 
 // Run Processors
-void dark_run_processor(Pixel_t *, const SortPlan_t *);
-void light_run_processor(Pixel_t *, const SortPlan_t *);
-void fixed_run_processor(Pixel_t *, const SortPlan_t *);
-void default_run_processor(Pixel_t *, const SortPlan_t *);
+long dark_run_processor(Pixel_t *, const SortPlan_t *);
+long light_run_processor(Pixel_t *, const SortPlan_t *);
+long fixed_run_processor(Pixel_t *, const SortPlan_t *);
+long default_run_processor(Pixel_t *, const SortPlan_t *);
 
 // Run Detectors
 int get_first_dark(const Pixel_t *, sort_val_fn_t, const int, const long);
@@ -80,6 +229,9 @@ static int MUL_VAL(const Pixel_t *);
 static int MAX_VAL(const Pixel_t *);
 static int MIN_VAL(const Pixel_t *);
 static int XOR_VAL(const Pixel_t *);
+static int LUMA_VAL(const Pixel_t *);
+static int HUE_VAL(const Pixel_t *);
+static int SAT_VAL(const Pixel_t *);
 
 // Comparison Funtions
 static int AVG_CMP(const Pixel_t *, const Pixel_t *);
@@ -87,6 +239,9 @@ static int MUL_CMP(const Pixel_t *, const Pixel_t *);
 static int MAX_CMP(const Pixel_t *, const Pixel_t *);
 static int MIN_CMP(const Pixel_t *, const Pixel_t *);
 static int XOR_CMP(const Pixel_t *, const Pixel_t *);
+static int LUMA_CMP(const Pixel_t *, const Pixel_t *);
+static int HUE_CMP(const Pixel_t *, const Pixel_t *);
+static int SAT_CMP(const Pixel_t *, const Pixel_t *);
 
 // Negated Comparison Funtions
 static int NOT_AVG_CMP(const Pixel_t *, const Pixel_t *);
@@ -94,6 +249,41 @@ static int NOT_MUL_CMP(const Pixel_t *, const Pixel_t *);
 static int NOT_MAX_CMP(const Pixel_t *, const Pixel_t *);
 static int NOT_MIN_CMP(const Pixel_t *, const Pixel_t *);
 static int NOT_XOR_CMP(const Pixel_t *, const Pixel_t *);
+static int NOT_LUMA_CMP(const Pixel_t *, const Pixel_t *);
+static int NOT_HUE_CMP(const Pixel_t *, const Pixel_t *);
+static int NOT_SAT_CMP(const Pixel_t *, const Pixel_t *);
+
+// Lookup Tables for the perceptual keys: Rec.709 luma weights per channel (16.16 fixed
+// point), and hue and saturation (0-255) per RGB colour quantized to HSV_BITS a channel
+static int luma_weights[COMPONENTS][256];
+static unsigned char hue_table[1 << (3 * HSV_BITS)];
+static unsigned char sat_table[1 << (3 * HSV_BITS)];
+
+/**
+ * Fills the lookup tables; runs once, before main
+ */
+static bool build_key_tables();
+static const bool key_tables_built = build_key_tables();
+
+/**
+ * Runs a block's steps as many times as it repeats, returning the pixels changed over all passes
+ */
+static long run_block(struct Image *, const PixelSortQuery_t *, const int, SortState_t *, rows_done_fn_t, void *);
+
+/**
+ * Runs a single subquery, returning the pixels it changed
+ */
+static long run_subquery(struct Image *, const PixelSortQuery_t *, const int, SortState_t *, rows_done_fn_t, void *);
+
+/**
+ * Copies a buffer, a memory budget's worth at a time for a disk-backed pool
+ */
+static void copy_budgeted(unsigned char *, const unsigned char *, const size_t, struct ScratchSpace *);
+
+/**
+ * Whether two buffers hold the same bytes, compared a memory budget's worth at a time
+ */
+static bool equal_budgeted(const unsigned char *, const unsigned char *, const size_t, struct ScratchSpace *);
 
 /**
  * Create a list of Pixel_t objects using the given Image and PixelSortingContext
@@ -118,28 +308,156 @@ static void destroy_sort_plan(SortPlan_t *);
 /**
  * Does the actual sort
  */
-static void do_sort(Pixel_t *, const SortPlan_t *);
+static long do_sort(Pixel_t *, const SortPlan_t *);
 
 /**
- * Copies a char offset to a pixel
+ * Copies a rows x cols pixel matrix into its transpose one tile at a time, keeping
+ * at most a memory budget's worth of a disk-backed source resident
  */
-static void set_pixel_from_buffer(const int, const unsigned char *, Pixel_t *);
+static void transpose_pixels(const unsigned char *, unsigned char *, const int, const int, struct ScratchSpace *);
 
-/**
- * Copies a pixel to a byte offset
- */
-static void set_buffer_from_pixel(const int, const Pixel_t *, unsigned char *);
+void sort(struct Image * img, const PixelSortQuery_t * query, SortEngine_e engine) {
+    sort_with_progress(img, query, engine, NULL, NULL);
+}
+
+void sort_with_progress(struct Image * img, const PixelSortQuery_t * query, SortEngine_e engine, rows_done_fn_t rows_done, void * rows_done_ctx) {
+    sort_steps(img, query, 0, get_block_step_count(query, 0), engine, rows_done, rows_done_ctx);
+}
+
+void sort_steps(struct Image * img, const PixelSortQuery_t * query, const int first_step, const int end_step, SortEngine_e engine, rows_done_fn_t rows_done, void * rows_done_ctx) {
+    // the reference engine has nothing to report until the end
+    if(REFERENCE_ENGINE == engine) {
+	reference_sort_steps(img, query, first_step, end_step);
+	if(NULL != rows_done) (*rows_done)(rows_done_ctx, get_height(img));
+	return;
+    }
+
+    // every line starts out dirty, with no known layout
+    SortState_t state;
+    state.lines[ROW].has_layout = state.lines[COLUMN].has_layout = false;
+    state.lines[ROW].dirty.assign(get_height(img), true);
+    state.lines[COLUMN].dirty.assign(get_width(img), true);
+    state.auto_thresholds.assign(get_subquery_count(query), -1);
+
+    for(int step = first_step; step < end_step; ++step) {
+	const bool is_final = (end_step - 1 == step);
+	const int idx = get_step_index(query, 0, step);
+	if(is_block_step(query, 0, step)) {
+	    run_block(img, query, idx, &state, is_final ? rows_done : NULL, rows_done_ctx);
+	} else {
+	    run_subquery(img, query, idx, &state, is_final ? rows_done : NULL, rows_done_ctx);
+	}
+    }
+
+    if(NULL != rows_done) (*rows_done)(rows_done_ctx, get_height(img));
+}
+
+long run_block(struct Image * img, const PixelSortQuery_t * query, const int block_idx, SortState_t * state, rows_done_fn_t rows_done, void * rows_done_ctx) {
+    const long repeat_count = get_repeat_count(query, block_idx);
+    const bool until_stable = is_until_stable(query, block_idx);
+    const int step_count = get_block_step_count(query, block_idx);
+
+    // steps can undo each other, so a pass has settled when the image matches a copy
+    // taken before it, whatever the steps moved along the way
+    struct BufferPool * pool = get_buffer_pool(img);
+    struct ScratchSpace * scratch = get_pool_scratch_space(pool);
+    const size_t bytes = (size_t)get_width(img) * get_height(img) * get_components(img);
+    unsigned char * pass_start = (until_stable && 1 < repeat_count) ? acquire_buffer(pool, bytes) : NULL;
+
+    long changed = 0;
+    for(long pass = 0; pass < repeat_count; ++pass) {
+	const bool is_last = (repeat_count - 1 == pass);
+	if(!is_last && NULL != pass_start) copy_budgeted(pass_start, get_buffer(img), bytes, scratch);
+
+	long pass_changed = 0;
+	for(int step = 0; step < step_count; ++step) {
+	    // rows are only final in the last step of a block that runs once
+	    const bool is_final = (1 == repeat_count && step_count - 1 == step);
+	    const int idx = get_step_index(query, block_idx, step);
+	    pass_changed += is_block_step(query, block_idx, step)
+		? run_block(img, query, idx, state, is_final ? rows_done : NULL, rows_done_ctx)
+		: run_subquery(img, query, idx, state, is_final ? rows_done : NULL, rows_done_ctx);
+	}
+	changed += pass_changed;
+
+	if(until_stable) {
+	    const bool settled = (0 == pass_changed) || (!is_last && NULL != pass_start && equal_budgeted(pass_start, get_buffer(img), bytes, scratch));
+	    fprintf(stderr, "Block %d pass %ld changed %ld pixels%s\n", block_idx, pass + 1, pass_changed, (settled && 0 < pass_changed) ? ", leaving the image as it was" : "");
+	    if(settled) break;
+	}
+    }
+
+    if(NULL != pass_start) release_buffer(pool, pass_start);
+    return changed;
+}
+
+void copy_budgeted(unsigned char * dst, const unsigned char * src, const size_t bytes, struct ScratchSpace * scratch) {
+	const size_t chunk = (NULL == scratch) ? bytes : std::max((size_t)sysconf(_SC_PAGESIZE), get_memory_budget(scratch) / 2);
+	for(size_t done = 0; done < bytes; done += chunk) {
+		const size_t length = std::min(chunk, bytes - done);
+		memcpy(dst + done, src + done, length);
+		if(NULL != scratch) {
+			evict_scratch_pages(src + done, length);
+			evict_scratch_pages(dst + done, length);
+		}
+	}
+}
+
+bool equal_budgeted(const unsigned char * a, const unsigned char * b, const size_t bytes, struct ScratchSpace * scratch) {
+	const size_t chunk = (NULL == scratch) ? bytes : std::max((size_t)sysconf(_SC_PAGESIZE), get_memory_budget(scratch) / 2);
+	for(size_t done = 0; done < bytes; done += chunk) {
+		const size_t length = std::min(chunk, bytes - done);
+		const bool equal = (0 == memcmp(a + done, b + done, length));
+		if(NULL != scratch) {
+			evict_scratch_pages(a + done, length);
+			evict_scratch_pages(b + done, length);
+		}
+		if(!equal) return false;
+	}
+	return true;
+}
+
+long run_subquery(struct Image * img, const PixelSortQuery_t * query, const int subquery_idx, SortState_t * state, rows_done_fn_t rows_done, void * rows_done_ctx) {
+	SortPlan_t * plan = create_sort_plan(img, query, subquery_idx);
 
-void sort(struct Image * img, const PixelSortQuery_t * query) {
-    for(int i = 0, l = get_subquery_count(query); i < l; ++i) {
-	SortPlan_t * plan = create_sort_plan(img, query, i);
+	// sorting only moves pixels within lines, so the image's keys (and the threshold
+	// picked from them) don't change between subqueries
+	if(is_auto_threshold(query, subquery_idx)) {
+		long & threshold = state->auto_thresholds[subquery_idx];
+		if(0 > threshold) threshold = get_auto_threshold(img, query, subquery_idx, plan);
+		plan->threshold = threshold;
+	}
+
+	// lines untouched since they were last sorted with this same layout can be skipped
+	LineState_t * lines = &state->lines[plan->orientation];
+	plan->skip_clean_lines = lines->has_layout
+		&& lines->run_processor_fn == plan->run_processor_fn
+		&& lines->compare_fn == plan->compare_fn
+		&& lines->threshold == plan->threshold
+		&& lines->arrange_fn == plan->arrange_fn
+		&& lines->operation_param == plan->operation_param;
+	plan->line_dirty = &lines->dirty;
+	plan->cross_dirty = &state->lines[(ROW == plan->orientation) ? COLUMN : ROW].dirty;
+
+	// rows of the final subquery are done as soon as they're sorted
+	if(ROW == plan->orientation) {
+	    plan->rows_done_fn = rows_done;
+	    plan->rows_done_ctx = rows_done_ctx;
+	}
 
 	Pixel_t * pixels = create_pixel_list(img, plan);
-	do_sort(pixels, plan);
+	const long changed = do_sort(pixels, plan);
+
+	lines->has_layout = true;
+	lines->run_processor_fn = plan->run_processor_fn;
+	lines->compare_fn = plan->compare_fn;
+	lines->threshold = plan->threshold;
+	lines->arrange_fn = plan->arrange_fn;
+	lines->operation_param = plan->operation_param;
 
 	sync_pixels(img, plan, pixels);
 	destroy_sort_plan(plan);
-    }
+	return changed;
 }
 
 // pulls pixels out of the image, transposing the matrix if necessary
@@ -149,17 +467,10 @@ Pixel_t * create_pixel_list(const struct Image * const img, const SortPlan_t * p
 	assert(COMPONENTS == components);
 
 	if(COLUMN == plan_ptr->orientation) {
-		Pixel_t * pixels = (Pixel_t*)malloc(sizeof(Pixel_t) * width * height);
-		for(int i = 0; i < width; ++i) {
-			for(int j = 0; j < height; ++j) {
-				int src_idx = ((j * width) + i);
-				int dst_idx = ((i * height) + j);
-				set_pixel_from_buffer(components, buffer + (src_idx * components), pixels + dst_idx);
-			}
-		}
-		
-		// free(buffer);
-		return pixels;
+		const size_t bytes = sizeof(Pixel_t) * width * height;
+		unsigned char * const pixels = acquire_buffer(plan_ptr->pool, bytes);
+		transpose_pixels(buffer, pixels, height, width, plan_ptr->scratch);
+		return (Pixel_t*)pixels;
 	} else {
 		return (Pixel_t*)buffer;
 	}
@@ -171,24 +482,16 @@ void sync_pixels(struct Image * img, const SortPlan_t * plan_ptr, const Pixel_t
 	assert(COMPONENTS == components);
 
 	if(COLUMN == plan_ptr->orientation) {
-		unsigned char * const buffer = (unsigned char *)malloc(sizeof(unsigned char) * width * height * components);
-		for(int i = 0; i < width; ++i) {
-			for(int j = 0; j < height; ++j) {
-				int src_idx = ((i * height) + j);
-				int dst_idx = ((j * width) + i);
-				unsigned char * data = buffer + (components * dst_idx);
-				set_buffer_from_pixel(components, pixels + src_idx, data);
-			}
-		}
-
-		// free(pixels);
-		set_buffer(img, buffer);
-	} else {
-		// set_buffer(img, pixels);
+		// the transposed list is written straight back over the source buffer
+		transpose_pixels((const unsigned char *)pixels, get_writable_buffer(img), width, height, plan_ptr->scratch);
+		release_buffer(plan_ptr->pool, (unsigned char *)pixels);
 	}
 }
 
 void destroy_sort_plan(SortPlan_t * plan_list_ptr) {
+    free(plan_list_ptr->run_copy);
+    free(plan_list_ptr->run_keys);
+    free(plan_list_ptr->run_order);
     free(plan_list_ptr);
 }
 
@@ -200,6 +503,16 @@ SortPlan_t * create_sort_plan(const Image * img, const PixelSortQuery_t * query,
 	plan->is_ascending = (ASC == get_sort_direction(query, subquery_idx)) ? 1 : 0;
 	plan->run_length = (ROW == o) ? get_width(img)  : get_height(img);
 	plan->run_count	 = (ROW == o) ? get_height(img) : get_width(img);
+	plan->pool = get_buffer_pool(img);
+	plan->scratch = get_pool_scratch_space(plan->pool);
+	plan->run_copy = (Pixel_t*)malloc(sizeof(Pixel_t) * plan->run_length);
+	plan->run_keys = (int*)malloc(sizeof(int) * plan->run_length);
+	plan->run_order = (uint64_t*)malloc(sizeof(uint64_t) * plan->run_length);
+	plan->key_range = (MUL == get_comparison(query, subquery_idx)) ? 0 : BYTE_KEY_RANGE;
+	plan->skip_clean_lines = false;
+	plan->line_dirty = plan->cross_dirty = NULL;
+	plan->rows_done_fn = NULL;
+	plan->rows_done_ctx = NULL;
 
 	// Set the run type
 	switch(get_run_type(query, subquery_idx)) {
@@ -217,10 +530,26 @@ SortPlan_t * create_sort_plan(const Image * img, const PixelSortQuery_t * query,
 			break;
 		case FULL:
 		default:
+			plan->threshold = 0;
 			plan->run_processor_fn = default_run_processor;
 			break;
 	}
 
+	// Set what happens to each run
+	plan->operation_param = get_operation_param(query, subquery_idx);
+	switch(get_operation(query, subquery_idx)) {
+		case PARTITION:
+			plan->arrange_fn = partition_arranger;
+			break;
+		case TOP:
+			plan->arrange_fn = top_arranger;
+			break;
+		case SORT:
+		default:
+			plan->arrange_fn = sort_arranger;
+			break;
+	}
+
 	// Set the comparison and sorting functions
 	switch(get_comparison(query, subquery_idx)) {
 		case AVG:
@@ -239,6 +568,18 @@ SortPlan_t * create_sort_plan(const Image * img, const PixelSortQuery_t * query,
 			plan->compare_fn = plan->is_ascending ? MIN_CMP : NOT_MIN_CMP;
 			plan->sort_val_fn = MIN_VAL;
 			break;
+		case LUMA:
+			plan->compare_fn = plan->is_ascending ? LUMA_CMP : NOT_LUMA_CMP;
+			plan->sort_val_fn = LUMA_VAL;
+			break;
+		case HUE:
+			plan->compare_fn = plan->is_ascending ? HUE_CMP : NOT_HUE_CMP;
+			plan->sort_val_fn = HUE_VAL;
+			break;
+		case SATURATION:
+			plan->compare_fn = plan->is_ascending ? SAT_CMP : NOT_SAT_CMP;
+			plan->sort_val_fn = SAT_VAL;
+			break;
 		case XOR:
 		default:
 			plan->compare_fn = plan->is_ascending ? XOR_CMP : NOT_XOR_CMP;
@@ -249,51 +590,339 @@ SortPlan_t * create_sort_plan(const Image * img, const PixelSortQuery_t * query,
 	return plan;
 }
 
-void do_sort(Pixel_t * pixels, const SortPlan_t * plan) {
+long do_sort(Pixel_t * pixels, const SortPlan_t * plan) {
+	const size_t run_bytes = sizeof(Pixel_t) * plan->run_length;
+	const int budget_runs = (NULL == plan->scratch) ? plan->run_count
+		: std::max(1, (int)(get_memory_budget(plan->scratch) / run_bytes));
+
+	long changed = 0, skipped = 0;
 	for(int run = 0; run < plan->run_count; ++run) {
-		(*plan->run_processor_fn)(pixels + (run * plan->run_length), plan);
+		if(plan->skip_clean_lines && !(*plan->line_dirty)[run]) {
+			++skipped;
+		} else {
+			changed += (*plan->run_processor_fn)(pixels + ((size_t)run * plan->run_length), plan);
+			(*plan->line_dirty)[run] = false;
+		}
+		if(NULL != plan->scratch && 0 == (run + 1) % budget_runs) {
+			evict_scratch_pages((unsigned char *)(pixels + ((size_t)(run + 1 - budget_runs) * plan->run_length)), budget_runs * run_bytes);
+		}
+		if(NULL != plan->rows_done_fn && 0 == (run + 1) % ROWS_PER_PROGRESS) {
+			(*plan->rows_done_fn)(plan->rows_done_ctx, run + 1);
+		}
 	}
+
+	if(0 < skipped) fprintf(stderr, "Skipped %ld of %d clean runs\n", skipped, plan->run_count);
+	return changed;
 }
 
-void dark_run_processor(Pixel_t * pixels, const SortPlan_t * plan_ptr) {
+long dark_run_processor(Pixel_t * pixels, const SortPlan_t * plan_ptr) {
 	const int length = plan_ptr->run_length, threshold = plan_ptr->threshold;
 	Pixel_t * cursor = pixels;
+	long changed = 0;
 	while(length > (cursor - pixels)) {
 		Pixel_t * start = cursor + get_first_non_dark(cursor, plan_ptr->sort_val_fn, length - (cursor - pixels), threshold);
 		Pixel_t * end = start + get_first_dark(start, plan_ptr->sort_val_fn, length - (start - pixels), threshold);
-		sort_run(start, end - start, plan_ptr->compare_fn);
+		changed += sort_run(start, end - start, plan_ptr, start - pixels);
 		cursor = end;
 	}
+	return changed;
 }
 
-void light_run_processor(Pixel_t * pixels, const SortPlan_t * plan) {
+long light_run_processor(Pixel_t * pixels, const SortPlan_t * plan) {
 	const int length = plan->run_length, threshold = plan->threshold;
 	Pixel_t * cursor = pixels;
+	long changed = 0;
 	while(length > (cursor - pixels)) {
 		Pixel_t * start = cursor + get_first_non_light(cursor, plan->sort_val_fn, length - (cursor - pixels), threshold);
 		Pixel_t * end = start + get_first_light(start, plan->sort_val_fn, length - (start - pixels), threshold);
-		sort_run(start, end - start, plan->compare_fn);
+		changed += sort_run(start, end - start, plan, start - pixels);
 		cursor = end;
 	}
+	return changed;
 }
 
-void fixed_run_processor(Pixel_t * pixels, const SortPlan_t * plan) {
+long fixed_run_processor(Pixel_t * pixels, const SortPlan_t * plan) {
 	const int length = plan->run_length, threshold = plan->threshold;
 	Pixel_t * cursor = pixels;
+	long changed = 0;
 	while(length > (cursor - pixels)) {
 		Pixel_t * start = cursor;
 		Pixel_t * end = start + get_next_fixed_end(start, length - (start - pixels), threshold);
-		sort_run(start, end - start, plan->compare_fn);
+		changed += sort_run(start, end - start, plan, start - pixels);
 		cursor = end;
 	}
+	return changed;
 }
 
-void default_run_processor(Pixel_t * pixels, const SortPlan_t * plan) {
-	sort_run(pixels, plan->run_length, plan->compare_fn);
+long default_run_processor(Pixel_t * pixels, const SortPlan_t * plan) {
+	return sort_run(pixels, plan->run_length, plan, 0);
 }
 
-void sort_run(Pixel_t * start, const int length, compare_fn_t cmp) {
-	qsort(start, length, sizeof(Pixel_t), (int(*)(const void*,const void*))cmp);
+long sort_run(Pixel_t * start, const int length, const SortPlan_t * plan, const int offset) {
+	// a run that's already in order is left exactly as it is (by partitions and top-k too)
+	if(is_sorted_run(start, length, plan->compare_fn)) return 0;
+
+	memcpy(plan->run_copy, start, sizeof(Pixel_t) * length);
+	(*plan->arrange_fn)(start, length, plan);
+
+	// each moved pixel dirties the line crossing this one at its position
+	long changed = 0;
+	for(int idx = 0; idx < length; ++idx) {
+		if(0 != memcmp(start + idx, plan->run_copy + idx, sizeof(Pixel_t))) {
+			(*plan->cross_dirty)[offset + idx] = true;
+			++changed;
+		}
+	}
+	return changed;
+}
+
+// pixels with equal keys keep their order from before the sort
+void sort_arranger(Pixel_t * start, const int length, const SortPlan_t * plan) {
+	// each key is extracted once, rather than twice per comparison
+	for(int idx = 0; idx < length; ++idx) {
+		const int key = (*plan->sort_val_fn)(start + idx);
+		plan->run_keys[idx] = plan->is_ascending ? key : -key;
+	}
+
+	if(0 < plan->key_range && length >= counting_sort_min_run) {
+		counting_sort_run(start, length, plan);
+	} else if(length <= network_sort_max_run) {
+		network_sort_run(start, length, plan);
+	} else {
+		key_sort_run(start, length, plan);
+	}
+}
+
+void network_sort_run(Pixel_t * start, const int length, const SortPlan_t * plan) {
+	// (key, position) words, padded past the run with words that sort last; every word
+	// differs, so the branchless compare-exchanges give the stable order
+	const int width = (4 >= length) ? 4 : 8;
+	uint64_t words[NETWORK_SORT_LIMIT];
+	for(int idx = 0; idx < width; ++idx) {
+		words[idx] = (idx < length) ? get_order_word(plan->run_keys[idx], idx) : UINT64_MAX;
+	}
+
+	if(4 == width) {
+		NETWORK_4(words)
+	} else {
+		NETWORK_8(words)
+	}
+
+	for(int idx = 0; idx < length; ++idx) {
+		start[idx] = plan->run_copy[(uint32_t)words[idx]];
+	}
+}
+
+void counting_sort_run(Pixel_t * start, const int length, const SortPlan_t * plan) {
+	// descending keys are negated, so shift them back into the table
+	const int bias = plan->is_ascending ? 0 : plan->key_range - 1;
+	int offsets[BYTE_KEY_RANGE + 1] = { 0 };
+	for(int idx = 0; idx < length; ++idx) ++offsets[plan->run_keys[idx] + bias + 1];
+	for(int key = 1; key <= BYTE_KEY_RANGE; ++key) offsets[key] += offsets[key - 1];
+
+	// scattering in run order keeps equal keys in their original order
+	for(int idx = 0; idx < length; ++idx) {
+		start[offsets[plan->run_keys[idx] + bias]++] = plan->run_copy[idx];
+	}
+}
+
+void key_sort_run(Pixel_t * start, const int length, const SortPlan_t * plan) {
+	// the position in the low bits breaks ties, so an unstable sort of the pairs is stable
+	for(int idx = 0; idx < length; ++idx) {
+		plan->run_order[idx] = get_order_word(plan->run_keys[idx], idx);
+	}
+	std::sort(plan->run_order, plan->run_order + length);
+	for(int idx = 0; idx < length; ++idx) {
+		start[idx] = plan->run_copy[(uint32_t)plan->run_order[idx]];
+	}
+}
+
+uint64_t get_order_word(const int key, const int idx) {
+	// flipping the sign bit orders negative keys before positive ones
+	return ((uint64_t)((uint32_t)key ^ 0x80000000u) << 32) | (uint32_t)idx;
+}
+
+long get_auto_threshold(const struct Image * img, const PixelSortQuery_t * query, const int subquery_idx, const SortPlan_t * plan) {
+	// byte keys get a bin each, wider keys are binned down to the histogram's size
+	const int shift = (0 < plan->key_range) ? 0 : WIDE_KEY_BITS - HISTOGRAM_BITS;
+	const int bins = (0 < plan->key_range) ? plan->key_range : (1 << HISTOGRAM_BITS);
+	const Pixel_t * pixels = (const Pixel_t *)get_buffer(img);
+	const size_t pixel_count = (size_t)get_width(img) * get_height(img);
+
+	// each thread fills its own histogram over a slice of the image
+	const int thread_count = std::max(1, (int)std::min((size_t)std::thread::hardware_concurrency(), pixel_count / HISTOGRAM_BLOCK + 1));
+	std::vector<long> histograms((size_t)thread_count * bins, 0);
+	std::vector<std::thread> workers;
+	for(int t = 0; t < thread_count; ++t) {
+		const size_t begin = (pixel_count * t) / thread_count, end = (pixel_count * (t + 1)) / thread_count;
+		workers.push_back(std::thread(histogram_range, pixels, begin, end, get_comparison(query, subquery_idx), shift, histograms.data() + ((size_t)t * bins), plan->scratch));
+	}
+	for(int t = 0; t < thread_count; ++t) {
+		workers[t].join();
+	}
+	for(int t = 1; t < thread_count; ++t) {
+		for(int bin = 0; bin < bins; ++bin) histograms[bin] += histograms[((size_t)t * bins) + bin];
+	}
+
+	// take in whole bins for as long as the runs stay within the percentage; DARK runs are
+	// the keys above the threshold, LIGHT runs those below it
+	const long target = (long)((pixel_count * get_run_threshold(query, subquery_idx)) / 100);
+	long threshold, in_runs = 0;
+	if(DARK == get_run_type(query, subquery_idx)) {
+		int bin = bins - 1;
+		for(; 0 <= bin && target >= in_runs + histograms[bin]; --bin) in_runs += histograms[bin];
+		threshold = ((long)(bin + 1) << shift) - 1;
+	} else {
+		int bin = 0;
+		for(; bins > bin && target >= in_runs + histograms[bin]; ++bin) in_runs += histograms[bin];
+		threshold = (long)bin << shift;
+	}
+
+	fprintf(stderr, "Auto threshold for subquery %d: %ld (%.1f%% of pixels in runs)\n", subquery_idx, threshold, (100.0 * in_runs) / pixel_count);
+	return threshold;
+}
+
+void histogram_range(const Pixel_t * pixels, const size_t begin, const size_t end, Comparison_e comparison, const int shift, long * histogram, struct ScratchSpace * scratch) {
+	const size_t step = (NULL == scratch) ? end - begin
+		: std::max((size_t)HISTOGRAM_BLOCK, get_memory_budget(scratch) / (sizeof(Pixel_t) * std::max(1u, std::thread::hardware_concurrency())));
+	for(size_t first = begin; first < end; first += step) {
+		const size_t last = std::min(end, first + step);
+		for(size_t block = first; block < last; block += HISTOGRAM_BLOCK) {
+			const int length = (int)std::min((size_t)HISTOGRAM_BLOCK, last - block);
+			switch(comparison) {
+				case AVG: histogram_block<AVG_VAL>(pixels + block, length, shift, histogram); break;
+				case MUL: histogram_block<MUL_VAL>(pixels + block, length, shift, histogram); break;
+				case MAX: histogram_block<MAX_VAL>(pixels + block, length, shift, histogram); break;
+				case MIN: histogram_block<MIN_VAL>(pixels + block, length, shift, histogram); break;
+				case LUMA: histogram_block<LUMA_VAL>(pixels + block, length, shift, histogram); break;
+				case HUE: histogram_block<HUE_VAL>(pixels + block, length, shift, histogram); break;
+				case SATURATION: histogram_block<SAT_VAL>(pixels + block, length, shift, histogram); break;
+				case XOR:
+				default: histogram_block<XOR_VAL>(pixels + block, length, shift, histogram); break;
+			}
+		}
+		if(NULL != scratch) evict_scratch_pages((const unsigned char *)(pixels + first), (last - first) * sizeof(Pixel_t));
+	}
+}
+
+template<int (*VAL)(const Pixel_t *)> void histogram_block(const Pixel_t * pixels, const int length, const int shift, long * histogram) {
+	int keys[HISTOGRAM_BLOCK];
+	for(int idx = 0; idx < length; ++idx) keys[idx] = VAL(pixels + idx) >> shift;
+	for(int idx = 0; idx < length; ++idx) ++histogram[keys[idx]];
+}
+
+void autotune_sort_cutoffs() {
+	// pixels that wander like a photo's, rather than uniform noise, sorted by AVG ascending
+	const int longest = 4096;
+	std::vector<Pixel_t> source(AUTOTUNE_PIXELS), run(longest);
+	srand(1);
+	int level = 128;
+	for(size_t idx = 0; idx < source.size(); ++idx) {
+		level = std::min(255, std::max(0, level + (rand() % (2 * AUTOTUNE_STEP + 1)) - AUTOTUNE_STEP));
+		source[idx].r = std::min(255, level + (rand() & 0xf));
+		source[idx].g = level;
+		source[idx].b = std::max(0, level - (rand() & 0xf));
+	}
+
+	SortPlan_t plan;
+	memset(&plan, 0, sizeof(SortPlan_t));
+	plan.is_ascending = 1;
+	plan.sort_val_fn = AVG_VAL;
+	plan.key_range = BYTE_KEY_RANGE;
+	plan.run_copy = (Pixel_t*)malloc(sizeof(Pixel_t) * longest);
+	plan.run_keys = (int*)malloc(sizeof(int) * longest);
+	plan.run_order = (uint64_t*)malloc(sizeof(uint64_t) * longest);
+
+	// a network is only worth its padding while it beats the comparison sort
+	network_sort_max_run = 0;
+	for(int length = 2; length <= NETWORK_SORT_LIMIT; ++length) {
+		if(time_strategy(network_sort_run, source.data(), length, &plan, run.data()) > time_strategy(key_sort_run, source.data(), length, &plan, run.data())) break;
+		network_sort_max_run = length;
+	}
+
+	// counting sort wins once the table's fixed cost is spread over enough pixels
+	counting_sort_min_run = longest;
+	for(int length = 16; length <= longest; length *= 2) {
+		if(time_strategy(counting_sort_run, source.data(), length, &plan, run.data()) < time_strategy(key_sort_run, source.data(), length, &plan, run.data())) {
+			counting_sort_min_run = length;
+			break;
+		}
+	}
+
+	free(plan.run_copy);
+	free(plan.run_keys);
+	free(plan.run_order);
+	fprintf(stderr, "Autotuned sort cutoffs: sorting networks up to %d pixels, counting sort from %d\n", network_sort_max_run, counting_sort_min_run);
+}
+
+double time_strategy(arrange_fn_t strategy, const Pixel_t * source, const int length, SortPlan_t * plan, Pixel_t * run) {
+	const int runs = AUTOTUNE_PIXELS / length;
+	double best = 0.0;
+	for(int round = 0; round < AUTOTUNE_ROUNDS; ++round) {
+		const std::chrono::steady_clock::time_point began = std::chrono::steady_clock::now();
+		for(int idx = 0; idx < runs; ++idx) {
+			const Pixel_t * pixels = source + ((size_t)idx * length);
+			memcpy(run, pixels, sizeof(Pixel_t) * length);
+			memcpy(plan->run_copy, pixels, sizeof(Pixel_t) * length);
+			for(int key = 0; key < length; ++key) plan->run_keys[key] = AVG_VAL(pixels + key);
+			(*strategy)(run, length, plan);
+		}
+		const double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - began).count() / runs;
+		if(0 == round || elapsed < best) best = elapsed;
+	}
+	return best;
+}
+
+// the pixels before the percentile's pixel, then those equal to it, then those after, each in their original order
+void partition_arranger(Pixel_t * start, const int length, const SortPlan_t * plan) {
+	const compare_fn_t cmp = plan->compare_fn;
+	const Pixel_t pivot = select_rank(start, length, (int)(((long)(length - 1) * plan->operation_param) / 100), plan);
+
+	Pixel_t * out = start;
+	for(int side = -1; side <= 1; ++side) {
+		for(int idx = 0; idx < length; ++idx) {
+			const int order = (*cmp)(plan->run_copy + idx, &pivot);
+			if((0 > order ? -1 : (0 < order ? 1 : 0)) == side) *out++ = plan->run_copy[idx];
+		}
+	}
+}
+
+// the k pixels a full sort would put last go to the end, sorted, and the rest keep their original order
+void top_arranger(Pixel_t * start, const int length, const SortPlan_t * plan) {
+	const compare_fn_t cmp = plan->compare_fn;
+	const int count = (int)std::min((long)length, plan->operation_param);
+	if(0 == count) return;
+	const Pixel_t pivot = select_rank(start, length, length - count, plan);
+
+	// of the pixels tied with the pivot, a stable sort puts the last ones last
+	int after = 0, tied = 0;
+	for(int idx = 0; idx < length; ++idx) {
+		const int order = (*cmp)(plan->run_copy + idx, &pivot);
+		if(0 < order) ++after;
+		else if(0 == order) ++tied;
+	}
+	int tied_before = tied - (count - after);
+
+	Pixel_t * head = start, * tail = start + (length - count);
+	for(int idx = 0; idx < length; ++idx) {
+		const int order = (*cmp)(plan->run_copy + idx, &pivot);
+		if(0 > order || (0 == order && 0 < tied_before--)) *head++ = plan->run_copy[idx];
+		else *tail++ = plan->run_copy[idx];
+	}
+	std::stable_sort(start + (length - count), start + length, [cmp](const Pixel_t & a, const Pixel_t & b) { return 0 > (*cmp)(&a, &b); });
+}
+
+Pixel_t select_rank(Pixel_t * start, const int length, const int rank, const SortPlan_t * plan) {
+	const compare_fn_t cmp = plan->compare_fn;
+	std::nth_element(start, start + rank, start + length, [cmp](const Pixel_t & a, const Pixel_t & b) { return 0 > (*cmp)(&a, &b); });
+	return start[rank];
+}
+
+int is_sorted_run(const Pixel_t * start, const int length, compare_fn_t cmp) {
+	for(int idx = 1; idx < length; ++idx) {
+		if(0 < (*cmp)(start + idx - 1, start + idx)) return 0;
+	}
+	return 1;
 }
 
 int get_next_fixed_end(const Pixel_t * pixels, const int remaining, const int interval) {
@@ -328,17 +957,57 @@ int get_first_non_light(const Pixel_t * pixels, sort_val_fn_t v, const int lengt
 	return length;
 }
 
-void set_pixel_from_buffer(const int components, const unsigned char * buffer, Pixel_t * pixel) {
-	unsigned char * const as_buffer = (unsigned char *)pixel;
-	for(int i = 0; i < components; ++i) {
-	    *(as_buffer + i) = *(buffer + i);
+void transpose_pixels(const unsigned char * src, unsigned char * dst, const int rows, const int cols, struct ScratchSpace * scratch) {
+	const size_t row_bytes = (size_t)cols * COMPONENTS;
+	const size_t page = sysconf(_SC_PAGESIZE);
+
+	// each block of source columns is a contiguous block of destination rows, sized to fill
+	// half of the budget (or a tile wide, evicted band by band, when even that won't fit);
+	// the other half holds a band of the block's source rows, where reading each row's
+	// slice also maps the pages the kernel faults in around it
+	int block = cols, band = rows;
+	bool block_fits = true;
+	if(NULL != scratch) {
+		const size_t half_budget = get_memory_budget(scratch) / 2;
+		const size_t budget_cols = half_budget / ((size_t)rows * COMPONENTS);
+		block_fits = (TILE_SIZE <= budget_cols);
+		block = block_fits ? (int)std::min((size_t)cols, budget_cols - (budget_cols % TILE_SIZE)) : TILE_SIZE;
+
+		const size_t slice_bytes = std::min(row_bytes, ((size_t)block * COMPONENTS) + FAULT_AROUND_BYTES);
+		size_t budget_rows = (half_budget - std::min(half_budget, (size_t)FAULT_AROUND_BYTES)) / slice_bytes;
+		if(!block_fits) budget_rows = std::min(budget_rows, ((half_budget / block) - std::min(half_budget / block, page)) / COMPONENTS);
+		if(TILE_SIZE <= budget_rows) budget_rows -= budget_rows % TILE_SIZE;
+		band = (int)std::max((size_t)1, std::min((size_t)rows, budget_rows));
 	}
-}
 
-void set_buffer_from_pixel(const int components, const Pixel_t * pixel, unsigned char * buffer) {
-	const unsigned char * const as_buffer = (unsigned char *)pixel;
-	for(int i = 0; i < components; ++i) {
-	    *(buffer + i) = *(as_buffer + i);
+	for(int block_start = 0; block_start < cols; block_start += block) {
+		const int block_end = std::min(cols, block_start + block);
+		for(int band_start = 0; band_start < rows; band_start += band) {
+			const int band_end = std::min(rows, band_start + band);
+			for(int tile_row = band_start; tile_row < band_end; tile_row += TILE_SIZE) {
+				const int row_end = std::min(band_end, tile_row + TILE_SIZE);
+				for(int tile_col = block_start; tile_col < block_end; tile_col += TILE_SIZE) {
+					const int col_end = std::min(block_end, tile_col + TILE_SIZE);
+					for(int c = tile_col; c < col_end; ++c) {
+						for(int r = tile_row; r < row_end; ++r) {
+							memcpy(dst + (((size_t)c * rows) + r) * COMPONENTS, src + (((size_t)r * cols) + c) * COMPONENTS, COMPONENTS);
+						}
+					}
+				}
+			}
+
+			// a block bigger than half the budget gives its destination pages back band by band
+			if(NULL != scratch) {
+				evict_scratch_pages(src + (band_start * row_bytes), (band_end - band_start) * row_bytes);
+				if(!block_fits) {
+					evict_scratch_pages(dst + ((size_t)block_start * rows * COMPONENTS), (size_t)(block_end - block_start) * rows * COMPONENTS);
+				}
+			}
+		}
+
+		if(NULL != scratch) {
+			evict_scratch_pages(dst + ((size_t)block_start * rows * COMPONENTS), (size_t)(block_end - block_start) * rows * COMPONENTS);
+		}
 	}
 }
 
@@ -392,6 +1061,33 @@ CMP_FN NOT_XOR_CMP(const Pixel_t * a, const Pixel_t * b) {
 }
 
 
+CMP_FN LUMA_CMP(const Pixel_t * a, const Pixel_t * b) {
+	return LUMA_VAL(a) - LUMA_VAL(b);
+}
+
+CMP_FN NOT_LUMA_CMP(const Pixel_t * a, const Pixel_t * b) {
+	return LUMA_VAL(b) - LUMA_VAL(a);
+}
+
+
+CMP_FN HUE_CMP(const Pixel_t * a, const Pixel_t * b) {
+	return HUE_VAL(a) - HUE_VAL(b);
+}
+
+CMP_FN NOT_HUE_CMP(const Pixel_t * a, const Pixel_t * b) {
+	return HUE_VAL(b) - HUE_VAL(a);
+}
+
+
+CMP_FN SAT_CMP(const Pixel_t * a, const Pixel_t * b) {
+	return SAT_VAL(a) - SAT_VAL(b);
+}
+
+CMP_FN NOT_SAT_CMP(const Pixel_t * a, const Pixel_t * b) {
+	return SAT_VAL(b) - SAT_VAL(a);
+}
+
+
 VAL_FN AVG_VAL(const Pixel_t * a) {
 	int avg = 0;
 	for(int c = 0, len = COMPONENTS; c < len; ++c) avg += ((unsigned char *)a)[c];
@@ -425,3 +1121,47 @@ VAL_FN XOR_VAL(const Pixel_t * a) {
 	for(int c = 1, len = COMPONENTS; c < len; ++c) orx ^= ((unsigned char *)a)[c];
 	return orx;
 }
+
+VAL_FN LUMA_VAL(const Pixel_t * a) {
+	return (luma_weights[0][a->r] + luma_weights[1][a->g] + luma_weights[2][a->b]) >> 16;
+}
+
+VAL_FN HUE_VAL(const Pixel_t * a) {
+	return hue_table[((a->r >> (8 - HSV_BITS)) << (2 * HSV_BITS)) | ((a->g >> (8 - HSV_BITS)) << HSV_BITS) | (a->b >> (8 - HSV_BITS))];
+}
+
+VAL_FN SAT_VAL(const Pixel_t * a) {
+	return sat_table[((a->r >> (8 - HSV_BITS)) << (2 * HSV_BITS)) | ((a->g >> (8 - HSV_BITS)) << HSV_BITS) | (a->b >> (8 - HSV_BITS))];
+}
+
+bool build_key_tables() {
+	// the weights sum to 1.0, and the rounding bias rides on the red table
+	const double weights[COMPONENTS] = { 0.2126, 0.7152, 0.0722 };
+	for(int v = 0; v < 256; ++v) {
+		for(int c = 0; c < COMPONENTS; ++c) {
+			luma_weights[c][v] = (int)(weights[c] * v * 65536.0) + (0 == c ? 0x8000 : 0);
+		}
+	}
+
+	// each quantized colour is represented by the centre of its bin
+	const int levels = 1 << HSV_BITS, half_bin = 1 << (7 - HSV_BITS);
+	for(int idx = 0; idx < levels * levels * levels; ++idx) {
+		const int r = ((idx >> (2 * HSV_BITS)) << (8 - HSV_BITS)) + half_bin;
+		const int g = (((idx >> HSV_BITS) & (levels - 1)) << (8 - HSV_BITS)) + half_bin;
+		const int b = ((idx & (levels - 1)) << (8 - HSV_BITS)) + half_bin;
+		const int max = std::max(r, std::max(g, b)), min = std::min(r, std::min(g, b));
+		const int delta = max - min;
+
+		double hue = 0.0;
+		if(0 < delta) {
+			if(max == r) hue = (double)(g - b) / delta;
+			else if(max == g) hue = 2.0 + (double)(b - r) / delta;
+			else hue = 4.0 + (double)(r - g) / delta;
+			if(0.0 > hue) hue += 6.0;
+		}
+
+		hue_table[idx] = (unsigned char)(hue * 256.0 / 6.0);
+		sat_table[idx] = (unsigned char)(0 < max ? (255 * delta) / max : 0);
+	}
+	return true;
+}
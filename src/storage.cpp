@@ -0,0 +1,269 @@
+#include "../include/storage.h"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <iostream>
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define HUGEPAGE_SIZE (2 << 20)
+#define CACHE_LINE_SIZE 64
+
+using namespace std;
+
+typedef struct ScratchSpace {
+	string directory;
+	size_t memory_budget;
+} ScratchSpace_t;
+
+typedef struct PooledBuffer {
+	unsigned char * buffer;
+	size_t capacity;
+	bool in_use;
+	bool is_snapshot;
+} PooledBuffer_t;
+
+typedef struct BufferPool {
+	struct ScratchSpace * scratch;
+	mutex lock;
+	vector<PooledBuffer_t> buffers;
+} BufferPool_t;
+
+typedef struct Snapshot {
+	int fd;
+	size_t bytes;
+} Snapshot_t;
+
+/**
+ * Creates an unlinked file in the scratch directory, or an anonymous memory file without one
+ */
+static int create_backing_file(struct ScratchSpace *, const size_t);
+
+struct ScratchSpace * create_scratch_space(const char * const directory, const size_t memory_budget) {
+	ScratchSpace_t * scratch = new ScratchSpace_t();
+	scratch->directory = string(directory);
+	scratch->memory_budget = memory_budget;
+	return scratch;
+}
+
+void destroy_scratch_space(struct ScratchSpace * scratch) {
+	delete scratch;
+}
+
+unsigned char * map_scratch_buffer(struct ScratchSpace * scratch, const size_t bytes) {
+	const int fd = create_backing_file(scratch, bytes);
+	void * const buffer = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(MAP_FAILED == buffer) {
+		cerr << "unable to map scratch file of " << bytes << " bytes (" << strerror(errno) << ")" << endl;
+		exit(1);
+	}
+
+	return (unsigned char *)buffer;
+}
+
+void unmap_scratch_buffer(unsigned char * buffer, const size_t bytes) {
+	munmap(buffer, bytes);
+}
+
+void evict_scratch_pages(const unsigned char * buffer, const size_t bytes) {
+	const size_t page = sysconf(_SC_PAGESIZE);
+	const size_t start = (size_t)buffer & ~(page - 1);
+	const size_t end = (size_t)buffer + bytes;
+
+	// write the dirty pages back and stop counting them against the process
+	msync((void *)start, end - start, MS_ASYNC);
+	madvise((void *)start, end - start, MADV_DONTNEED);
+}
+
+size_t get_memory_budget(const struct ScratchSpace * scratch) {
+	return scratch->memory_budget;
+}
+
+struct BufferPool * create_buffer_pool(struct ScratchSpace * scratch) {
+	BufferPool_t * pool = new BufferPool_t();
+	pool->scratch = scratch;
+	return pool;
+}
+
+void destroy_buffer_pool(struct BufferPool * pool) {
+	for(size_t i = 0; i < pool->buffers.size(); ++i) {
+		if(pool->buffers[i].in_use) {
+			cerr << "destroying buffer pool with a buffer still in use" << endl;
+		}
+		if(NULL == pool->scratch && !pool->buffers[i].is_snapshot) {
+			free(pool->buffers[i].buffer);
+		} else {
+			unmap_scratch_buffer(pool->buffers[i].buffer, pool->buffers[i].capacity);
+		}
+	}
+	delete pool;
+}
+
+unsigned char * acquire_buffer(struct BufferPool * pool, const size_t bytes) {
+	lock_guard<mutex> guard(pool->lock);
+
+	// reuse the smallest idle buffer that fits
+	PooledBuffer_t * best = NULL;
+	for(size_t i = 0; i < pool->buffers.size(); ++i) {
+		PooledBuffer_t * candidate = &pool->buffers[i];
+		if(!candidate->in_use && bytes <= candidate->capacity && (NULL == best || candidate->capacity < best->capacity)) {
+			best = candidate;
+		}
+	}
+	if(NULL != best) {
+		best->in_use = true;
+		return best->buffer;
+	}
+
+	PooledBuffer_t created;
+	created.capacity = bytes;
+	created.in_use = true;
+	created.is_snapshot = false;
+	if(NULL != pool->scratch) {
+		created.buffer = map_scratch_buffer(pool->scratch, bytes);
+	} else {
+		// image-sized buffers are hugepage aligned so the kernel can back them with hugepages
+		const size_t alignment = (HUGEPAGE_SIZE <= bytes) ? HUGEPAGE_SIZE : CACHE_LINE_SIZE;
+		created.capacity = (bytes + alignment - 1) & ~(alignment - 1);
+
+		void * buffer = NULL;
+		if(0 != posix_memalign(&buffer, alignment, created.capacity)) {
+			cerr << "unable to allocate a " << bytes << " byte buffer" << endl;
+			exit(1);
+		}
+		if(HUGEPAGE_SIZE <= bytes) madvise(buffer, created.capacity, MADV_HUGEPAGE);
+		created.buffer = (unsigned char *)buffer;
+	}
+
+	pool->buffers.push_back(created);
+	return created.buffer;
+}
+
+void release_buffer(struct BufferPool * pool, unsigned char * buffer) {
+	lock_guard<mutex> guard(pool->lock);
+	for(size_t i = 0; i < pool->buffers.size(); ++i) {
+		if(buffer == pool->buffers[i].buffer) {
+			assert(pool->buffers[i].in_use);
+			pool->buffers[i].in_use = false;
+
+			// snapshot mappings hold private copies of touched pages, so they aren't reused
+			if(pool->buffers[i].is_snapshot) {
+				munmap(buffer, pool->buffers[i].capacity);
+				pool->buffers.erase(pool->buffers.begin() + i);
+				return;
+			}
+
+			// an idle disk-backed buffer shouldn't count against the memory budget
+			if(NULL != pool->scratch) evict_scratch_pages(buffer, pool->buffers[i].capacity);
+			return;
+		}
+	}
+
+	cerr << "released a buffer the pool does not own" << endl;
+	exit(1);
+}
+
+struct ScratchSpace * get_pool_scratch_space(const struct BufferPool * pool) {
+	return pool->scratch;
+}
+
+struct Snapshot * create_snapshot(struct BufferPool * pool, const unsigned char * buffer, const size_t bytes) {
+	Snapshot_t * snapshot = new Snapshot_t();
+	snapshot->bytes = bytes;
+	snapshot->fd = create_backing_file(pool->scratch, bytes);
+
+	// a disk-backed buffer is written a budget's worth at a time, letting each chunk's
+	// pages go once it's written so the copy doesn't fault the whole image in
+	const size_t page = sysconf(_SC_PAGESIZE);
+	const size_t chunk = (NULL == pool->scratch) ? bytes : max(page, pool->scratch->memory_budget & ~(page - 1));
+	for(size_t written = 0; written < bytes; ) {
+		const size_t chunk_end = min(bytes, written + chunk);
+		const ssize_t result = pwrite(snapshot->fd, buffer + written, chunk_end - written, written);
+		if(0 > result) {
+			cerr << "unable to write snapshot (" << strerror(errno) << ")" << endl;
+			exit(1);
+		}
+		if(NULL != pool->scratch) evict_scratch_pages(buffer + written, result);
+		written += result;
+	}
+	return snapshot;
+}
+
+void destroy_snapshot(struct Snapshot * snapshot) {
+	close(snapshot->fd);
+	delete snapshot;
+}
+
+unsigned char * acquire_snapshot_buffer(struct BufferPool * pool, const struct Snapshot * snapshot) {
+	return acquire_file_buffer(pool, snapshot->fd, 0, snapshot->bytes);
+}
+
+unsigned char * acquire_file_buffer(struct BufferPool * pool, const int source_fd, const size_t offset, const size_t bytes) {
+	PooledBuffer_t created;
+	created.capacity = bytes;
+	created.in_use = true;
+	created.is_snapshot = (NULL == pool->scratch);
+
+	// evicting pages from a private mapping would throw away its changes, so disk-backed
+	// pools clone the range into a scratch file of their own (sharing extents where
+	// the filesystem can) and map that shared, like any other scratch buffer
+	int fd = source_fd;
+	off_t map_offset = offset;
+	if(NULL != pool->scratch) {
+		fd = create_backing_file(pool->scratch, bytes);
+		map_offset = 0;
+		loff_t in_offset = offset, out_offset = 0;
+		while((size_t)out_offset < bytes) {
+			const ssize_t result = copy_file_range(source_fd, &in_offset, fd, &out_offset, bytes - out_offset, 0);
+			if(0 >= result) {
+				cerr << "unable to copy " << bytes << " bytes into scratch space (" << strerror(errno) << ")" << endl;
+				exit(1);
+			}
+		}
+	}
+
+	void * const buffer = mmap(NULL, bytes, PROT_READ | PROT_WRITE, created.is_snapshot ? MAP_PRIVATE : MAP_SHARED, fd, map_offset);
+	if(fd != source_fd) close(fd);
+	if(MAP_FAILED == buffer) {
+		cerr << "unable to map " << bytes << " bytes of a file (" << strerror(errno) << ")" << endl;
+		exit(1);
+	}
+	created.buffer = (unsigned char *)buffer;
+
+	lock_guard<mutex> guard(pool->lock);
+	pool->buffers.push_back(created);
+	return created.buffer;
+}
+
+int create_backing_file(struct ScratchSpace * scratch, const size_t bytes) {
+	int fd = -1;
+	if(NULL == scratch) {
+		fd = memfd_create("pixelsort", 0);
+	} else {
+		string path = scratch->directory + "/pixelsort-XXXXXX";
+		char * const path_buffer = strdup(path.c_str());
+
+		// the file only lives as long as it's open or mapped
+		if(0 <= (fd = mkstemp(path_buffer))) unlink(path_buffer);
+		free(path_buffer);
+	}
+
+	if(0 > fd) {
+		cerr << "unable to create a backing file (" << strerror(errno) << ")" << endl;
+		exit(1);
+	}
+	if(0 != ftruncate(fd, bytes)) {
+		cerr << "unable to size backing file to " << bytes << " bytes (" << strerror(errno) << ")" << endl;
+		exit(1);
+	}
+	return fd;
+}
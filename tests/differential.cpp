@@ -0,0 +1,295 @@
+#include "../include/read_write.h"
+#include "../include/parser.h"
+#include "../include/sorting.h"
+#include "../include/storage.h"
+
+#include <string>
+#include <vector>
+#include <random>
+
+#include <cstdlib>
+#include <cstdio>
+
+#include <unistd.h>
+
+#include "jpeglib.h"
+
+// runs seeded random images through seeded random queries with both engines, and fails
+// on any byte that differs; then encodes more random images in parallel strips, and fails
+// on any byte that differs from the single-threaded encoder; usage: differential [cases] [seed]
+
+#define DEFAULT_CASES 300
+#define DEFAULT_SEED 1
+#define MAX_SIDE 96
+#define MAX_STEPS 3
+#define MAX_DEPTH 2
+#define MAX_REPEAT 3
+#define MAX_FIXED_RUN 24
+#define MAX_MUL_KEY (255 * 255 * 255)
+#define MAX_SCRATCH_BUDGET (64 << 10)
+
+// a fifth as many encoder cases as sort cases, on 2-4 threads; strips are a multiple of
+// 8 MCU rows, 128 pixel rows with the default 2x2 chroma sampling, and an image has to
+// be taller than one strip to be split
+#define ENCODER_CASES_PER_SORT_CASE 5
+#define MIN_ENCODER_THREADS 2
+#define MAX_ENCODER_THREADS 4
+#define STRIP_ALIGNMENT 128
+#define MAX_STRIPS 4
+
+using namespace std;
+
+typedef mt19937 Random_t;
+
+/**
+ * A uniform pick from [low, high]
+ */
+static int pick(Random_t &, const int, const int);
+
+/**
+ * Creates an empty file in the directory, filling in its path
+ */
+static bool create_temp_file(const char * const, vector<char> &);
+
+/**
+ * A height for the strip encoder: just past a strip boundary, a multiple of the MCU
+ * height, or anything taller than one strip
+ */
+static int pick_strip_height(Random_t &);
+
+/**
+ * Whether an encoded file has restart markers, as only the strip encoder writes them;
+ * otherwise the comparison with the single-threaded encoder checks nothing
+ */
+static bool has_restart_markers(const char * const);
+
+/**
+ * Writes a random image as a JPEG: noise, gradients, a few flat colours (for ties) or a
+ * random walk like a photo's
+ */
+static void write_random_jpeg(Random_t &, const char * const, const int, const int);
+
+/**
+ * A random chain of steps, with REPEAT blocks nested up to the given depth
+ */
+static string random_chain(Random_t &, const int, const int);
+
+/**
+ * A random subquery, covering every operation, key and run type
+ */
+static string random_subquery(Random_t &, const int);
+
+int main(const int argc, const char** argv) {
+	const int cases = (1 < argc) ? atoi(argv[1]) : DEFAULT_CASES;
+	const unsigned long seed = (2 < argc) ? strtoul(argv[2], NULL, 10) : DEFAULT_SEED;
+	const char * tmp_dir = (NULL != getenv("TMPDIR")) ? getenv("TMPDIR") : "/tmp";
+
+	// the sorter and parser narrate everything, so only the results go to the real stderr
+	FILE * report = fdopen(dup(fileno(stderr)), "w");
+	if(NULL == freopen("/dev/null", "w", stdout) || NULL == freopen("/dev/null", "w", stderr)) {
+		fprintf(report, "unable to silence the sorter's output\n");
+		return 1;
+	}
+
+	vector<char> path_buffer, encoded_buffer;
+	if(!create_temp_file(tmp_dir, path_buffer) || !create_temp_file(tmp_dir, encoded_buffer)) {
+		fprintf(report, "unable to create a temporary file in %s\n", tmp_dir);
+		return 1;
+	}
+
+	int failures = 0;
+	for(int idx = 0; idx < cases; ++idx) {
+		Random_t random(seed + idx);
+		const int width = pick(random, 1, MAX_SIDE), height = pick(random, 1, MAX_SIDE);
+		write_random_jpeg(random, path_buffer.data(), width, height);
+
+		// a third of the cases run out of core, with a budget of a few rows or columns
+		const size_t budget = (0 == pick(random, 0, 2)) ? (size_t)pick(random, 1, MAX_SCRATCH_BUDGET) : 0;
+		struct ScratchSpace * scratch = (0 == budget) ? NULL : create_scratch_space(tmp_dir, budget);
+		struct BufferPool * pool = create_buffer_pool(scratch);
+
+		const string query_text = random_chain(random, max(width, height), MAX_DEPTH);
+		struct PixelSortQuery * query = process_tokens(query_text.c_str());
+		struct Image * optimized = read_image(path_buffer.data(), pool);
+		struct Image * reference = copy_image(optimized);
+		sort(optimized, query, OPTIMIZED_ENGINE);
+		sort(reference, query, REFERENCE_ENGINE);
+
+		const size_t differing = count_differing_bytes(optimized, reference);
+		if(0 < differing) {
+			++failures;
+			fprintf(report, "case %d (seed %lu): %dx%d, scratch budget %zu: %zu bytes differ\n  %s\n", idx, seed + idx, width, height, budget, differing, query_text.c_str());
+		}
+
+		destroy_image(optimized);
+		destroy_image(reference);
+		destroy_query(query);
+		destroy_buffer_pool(pool);
+		if(NULL != scratch) destroy_scratch_space(scratch);
+	}
+
+	fprintf(report, "%d of %d cases differ between the optimized and reference engines (seeds %lu-%lu)\n", failures, cases, seed, seed + cases - 1);
+
+	// the encoder cases follow on from the sort cases' seeds
+	const int encoder_cases = max(1, cases / ENCODER_CASES_PER_SORT_CASE);
+	int encoder_failures = 0;
+	for(int idx = 0; idx < encoder_cases; ++idx) {
+		Random_t random(seed + cases + idx);
+		const int width = pick(random, 1, MAX_SIDE), height = pick_strip_height(random);
+		write_random_jpeg(random, path_buffer.data(), width, height);
+
+		const int threads = pick(random, MIN_ENCODER_THREADS, MAX_ENCODER_THREADS);
+		set_encoder_threads(threads);
+		struct BufferPool * pool = create_buffer_pool(NULL);
+		struct Image * img = read_image(path_buffer.data(), pool);
+		write_image(img, encoded_buffer.data(), NULL);
+
+		const size_t differing = count_differing_encoded_bytes(img, encoded_buffer.data());
+		if(!has_restart_markers(encoded_buffer.data())) {
+			++encoder_failures;
+			fprintf(report, "encoder case %d (seed %lu): %dx%d on %d threads was not split into strips\n", idx, seed + cases + idx, width, height, threads);
+		} else if(0 < differing) {
+			++encoder_failures;
+			fprintf(report, "encoder case %d (seed %lu): %dx%d on %d threads: %zu encoded bytes differ\n", idx, seed + cases + idx, width, height, threads, differing);
+		}
+
+		destroy_image(img);
+		destroy_buffer_pool(pool);
+	}
+	set_encoder_threads(0);
+
+	unlink(path_buffer.data());
+	unlink(encoded_buffer.data());
+	fprintf(report, "%d of %d parallel encodes differ from the single-threaded encoder (seeds %lu-%lu)\n", encoder_failures, encoder_cases, seed + cases, seed + cases + encoder_cases - 1);
+	return (0 == failures && 0 == encoder_failures) ? 0 : 1;
+}
+
+int pick(Random_t & random, const int low, const int high) {
+	return uniform_int_distribution<int>(low, high)(random);
+}
+
+bool create_temp_file(const char * const directory, vector<char> & path) {
+	const string pattern = string(directory) + "/pixelsort-check-XXXXXX";
+	path.assign(pattern.begin(), pattern.end());
+	path.push_back('\0');
+	const int fd = mkstemp(path.data());
+	if(0 > fd) return false;
+	close(fd);
+	return true;
+}
+
+bool has_restart_markers(const char * const file) {
+	FILE * src = fopen(file, "rb");
+	if(NULL == src) return false;
+	bool found = false;
+	for(int previous = EOF, byte = fgetc(src); !found && EOF != byte; previous = byte, byte = fgetc(src)) {
+		found = (0xFF == previous && 0xD0 <= byte && 0xD7 >= byte);
+	}
+	fclose(src);
+	return found;
+}
+
+int pick_strip_height(Random_t & random) {
+	const int strips = pick(random, 1, MAX_STRIPS);
+	switch(pick(random, 0, 2)) {
+		case 0: return (strips * STRIP_ALIGNMENT) + 1;
+		case 1: return (strips * STRIP_ALIGNMENT) + (16 * pick(random, 1, (STRIP_ALIGNMENT / 16) - 1));
+		default: return (strips * STRIP_ALIGNMENT) + pick(random, 1, STRIP_ALIGNMENT - 1);
+	}
+}
+
+void write_random_jpeg(Random_t & random, const char * const file, const int width, const int height) {
+	const int style = pick(random, 0, 3);
+	vector<unsigned char> palette(3 * pick(random, 2, 6));
+	for(size_t idx = 0; idx < palette.size(); ++idx) palette[idx] = pick(random, 0, 255);
+
+	vector<unsigned char> pixels((size_t)width * height * 3);
+	int level = pick(random, 0, 255);
+	for(size_t idx = 0; idx < (size_t)width * height; ++idx) {
+		const int x = idx % width, y = idx / width;
+		for(int c = 0; c < 3; ++c) {
+			unsigned char & value = pixels[(3 * idx) + c];
+			switch(style) {
+				case 0: value = pick(random, 0, 255); break;
+				case 1: value = min(255, ((x * 255) / width + (y * (c + 1) * 64) / height + pick(random, 0, 31)) & 0xff); break;
+				case 2: value = palette[(3 * (idx % (palette.size() / 3))) + c]; break;
+				default:
+					if(0 == c) level = min(255, max(0, level + pick(random, -12, 12)));
+					value = min(255, max(0, level + pick(random, -8, 8)));
+					break;
+			}
+		}
+	}
+
+	FILE * dest = fopen(file, "wb");
+	struct jpeg_compress_struct c_info;
+	struct jpeg_error_mgr jpg_err;
+	c_info.err = jpeg_std_error(&jpg_err);
+	jpeg_create_compress(&c_info);
+	jpeg_stdio_dest(&c_info, dest);
+	c_info.image_width = width;
+	c_info.image_height = height;
+	c_info.input_components = 3;
+	c_info.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&c_info);
+	jpeg_set_quality(&c_info, pick(random, 50, 100), TRUE);
+	jpeg_start_compress(&c_info, TRUE);
+	for(int row = 0; row < height; ++row) {
+		JSAMPROW row_pointer = pixels.data() + ((size_t)row * width * 3);
+		jpeg_write_scanlines(&c_info, &row_pointer, 1);
+	}
+	jpeg_finish_compress(&c_info);
+	jpeg_destroy_compress(&c_info);
+	fclose(dest);
+}
+
+string random_chain(Random_t & random, const int longest_run, const int depth) {
+	string chain;
+	for(int step = 0, steps = pick(random, 1, MAX_STEPS); step < steps; ++step) {
+		if(0 < step) chain += " THEN ";
+
+		// blocks without a count repeat until stable, sometimes with steps that undo each
+		// other, so only a pass that leaves the image as it was stops them early
+		if(0 < depth && 0 == pick(random, 0, 3)) {
+			if(pick(random, 0, 2)) {
+				chain += "REPEAT " + to_string(pick(random, 1, MAX_REPEAT)) + " { " + random_chain(random, longest_run, depth - 1) + " }";
+				if(pick(random, 0, 1)) chain += " UNTIL STABLE";
+			} else if(pick(random, 0, 1)) {
+				chain += "REPEAT { " + random_chain(random, longest_run, depth - 1) + " } UNTIL STABLE";
+			} else {
+				const string lines = pick(random, 0, 1) ? " ROWS" : " COLS";
+				chain += "REPEAT { SORT" + lines + " ASC BY AVG WITH FULL RUNS THEN SORT" + lines + " DESC BY AVG WITH FULL RUNS } UNTIL STABLE";
+			}
+		} else {
+			chain += random_subquery(random, longest_run);
+		}
+	}
+	return chain;
+}
+
+string random_subquery(Random_t & random, const int longest_run) {
+	static const char * const keys[] = { "AVG", "MUL", "MAX", "MIN", "XOR", "LUMA", "HUE", "SATURATION" };
+	const string key = keys[pick(random, 0, 7)];
+	const int max_key = ("MUL" == key) ? MAX_MUL_KEY : 255;
+
+	string subquery;
+	const int operation = pick(random, 0, 3);
+	if(2 > operation) subquery = "SORT";
+	else if(2 == operation) subquery = "PARTITION";
+	else subquery = "TOP " + to_string(pick(random, 1, longest_run + 2));
+
+	subquery += pick(random, 0, 1) ? " ROWS" : " COLS";
+	subquery += pick(random, 0, 1) ? " ASC" : " DESC";
+	subquery += " BY " + key;
+	if(2 == operation) subquery += " AT " + to_string(pick(random, 0, 100));
+
+	switch(pick(random, 0, 5)) {
+		case 0: subquery += " WITH FULL RUNS"; break;
+		case 1: subquery += " WITH FIXED " + to_string(pick(random, 1, MAX_FIXED_RUN)) + " RUNS"; break;
+		case 2: subquery += " WITH DARK " + to_string(pick(random, 0, max_key)) + " RUNS"; break;
+		case 3: subquery += " WITH LIGHT " + to_string(pick(random, 0, max_key)) + " RUNS"; break;
+		case 4: subquery += " WITH DARK AUTO " + to_string(pick(random, 0, 100)) + " RUNS"; break;
+		default: subquery += " WITH LIGHT AUTO " + to_string(pick(random, 0, 100)) + " RUNS"; break;
+	}
+	return subquery;
+}